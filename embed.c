@@ -1,4 +1,7 @@
-/* H2 Forth Virtual Machine, Richard James Howe, 2017-2019, MIT License */
+/* H2 Forth Virtual Machine, Richard James Howe, 2017-2019, MIT License
+ * Build with -DNO_MAIN for the library alone, see 'embed.h'. */
+#define _POSIX_C_SOURCE 200809L
+#include "embed.h"
 #include <assert.h>
 #include <errno.h>
 #include <stdarg.h>
@@ -6,99 +9,152 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-#define STK         (64)
-#define USE_HEX_IN  (0)
-#define USE_HEX_OUT (1)
-
-typedef uint16_t m_t;
-typedef  int16_t s_t;
-typedef uint32_t d_t;
-typedef struct forth_t { m_t m[32768], vs[STK], rs[STK], pc, t, rp, sp, cpu; } forth_t;
-typedef int (*cb)(forth_t *h, void *param); 
+#define STK         EMBED_STK
+#define SAVE_CHUNK  (512) /* cells formatted per 'fwrite' */
 
 static inline size_t cells(forth_t const * const h) { 
 	assert(h); 
 	return sizeof(h->m)/sizeof(h->m[0]); 
 }
 
-static void die(const char *fmt, ...) {
-	assert(fmt);
-	va_list arg;
-	va_start(arg, fmt);
-	vfprintf(stderr, fmt, arg);
-	va_end(arg);
-	fputc('\n', stderr);
-	exit(EXIT_FAILURE);
+forth_t *embed_new(void) { return calloc(1, sizeof(forth_t)); }
+
+void embed_free(forth_t *h) { free(h); }
+
+forth_t *embed_copy(const forth_t *h) {
+	assert(h);
+	forth_t *r = malloc(sizeof(*r));
+	if (r)
+		memcpy(r, h, sizeof(*r));
+	return r;
 }
 
-static FILE *fopen_or_die(const char *file, const char *mode) {
-	assert(file && mode);
-	FILE *h = NULL;
-	errno = 0;
-	if (!(h = fopen(file, mode)))
-		die("file open %s (mode %s) failed: %s", file, mode, strerror(errno));
-	return h;
+void embed_push(forth_t *h, const m_t value) {
+	assert(h);
+	h->vs[++h->sp % STK] = h->t;
+	h->t = value;
+}
+
+m_t embed_pop(forth_t *h) {
+	assert(h);
+	const m_t r = h->t;
+	h->t = h->vs[h->sp-- % STK];
+	return r;
 }
 
-static int save(forth_t *h, const char *name, const size_t start, const size_t length) {
+int embed_save(const forth_t *h, const char *name, const size_t start, const size_t length, const unsigned options) {
 	assert(h);
 	if (!name || !(((length - start) <= length) && ((start + length) <= cells(h))))
 		return -69; /* open-file IOR */
 	FILE *out = fopen(name, "wb");
 	if (!out)
 		return -69; /* open-file IOR */
+	static const char digits[] = "0123456789abcdef";
+	const int binary = !!(options & EMBED_BINARY);
+	char buffer[SAVE_CHUNK * 5];
 	int r = 0;
-	for (size_t i = start; i < length; i++) {
-		if (USE_HEX_OUT) {
-			fprintf(out, "%02x%02x\n", ((unsigned)(h->m[i] >> 8) & 255u), (unsigned)(h->m[i] >> 0) & 255u);
-		} else {
-			if (fputc(h->m[i]&255, out) < 0 || fputc(h->m[i]>>8, out) < 0)
-				r = -76; /* write-file IOR */
+	for (size_t i = start; i < length && !r;) {
+		size_t used = 0;
+		for (const size_t end = i + SAVE_CHUNK; i < length && i < end; i++) {
+			const m_t c = h->m[i];
+			if (binary) {
+				buffer[used++] = c & 255u;
+				buffer[used++] = c >> 8;
+			} else {
+				buffer[used++] = digits[(c >> 12) & 15u];
+				buffer[used++] = digits[(c >>  8) & 15u];
+				buffer[used++] = digits[(c >>  4) & 15u];
+				buffer[used++] = digits[ c        & 15u];
+				buffer[used++] = '\n';
+			}
 		}
+		if (fwrite(buffer, 1, used, out) != used)
+			r = -76; /* write-file IOR */
 	}
 	return fclose(out) < 0 ? -62 /* close-file IOR */ : r;
 }
 
-static int load(forth_t *h, const char *name) {
+int embed_load(forth_t *h, const char *name) {
 	assert(h && name);
-	FILE *input = fopen_or_die(name, "rb");
-	long r = 0;
-	for (size_t i = 0; i < cells(h); i++, r = i) {
-		if (USE_HEX_IN) {
-			unsigned d = 0;
-			if (fscanf(input, "%x", &d) != 1) {
-				r = -1;
-				break;
-			}
-			h->m[i] = d;
-		} else {
-			int c1 = 0, c2 = 0;
-			if ((c1 = fgetc(input)) < 0 || (c2 = fgetc(input)) < 0)
-				break;
-			h->m[i] = ((c1 & 0xffu)) | ((c2 & 0xffu) << 8u);
+	int r = -70; /* read-file IOR */
+#ifdef __unix__
+	const int fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return -69; /* open-file IOR */
+	struct stat s;
+	if (fstat(fd, &s) == 0 && s.st_size > 0) {
+		void *image = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (image != MAP_FAILED) {
+			r = embed_load_buffer(h, image, s.st_size);
+			munmap(image, s.st_size);
 		}
 	}
+	close(fd);
+#else
+	FILE *input = fopen(name, "rb");
+	if (!input)
+		return -69; /* open-file IOR */
+	uint8_t *image = malloc(sizeof(h->m));
+	if (image)
+		r = embed_load_buffer(h, image, fread(image, 1, sizeof(h->m), input));
+	free(image);
 	fclose(input);
-	return r < 64 ? -70 /* read-file IOR */ : 0; /* minimum size checks, 128 bytes */
+#endif
+	return r;
 }
 
-static inline void trace(FILE *out, m_t opt, m_t *m, m_t pc, m_t instruction, m_t t, m_t rp, m_t sp) {
+int embed_load_buffer(forth_t *h, const uint8_t *buffer, const size_t length) {
+	assert(h && buffer);
+	const size_t n = length / 2 < cells(h) ? length / 2 : cells(h);
+	if (n < 64)
+		return -70; /* read-file IOR */
+	for (size_t i = 0; i < n; i++)
+		h->m[i] = ((m_t)buffer[i * 2]) | ((m_t)buffer[(i * 2) + 1] << 8u);
+	return 0;
+}
+
+static int put_file(int ch, void *out) { return fputc(ch, out); }
+static int get_file(void *in) { return fgetc(in); }
+
+static inline void trace(m_t opt, m_t *m, m_t pc, m_t instruction, m_t t, m_t rp, m_t sp) {
 	(void)m;
-	if (!(opt & 1))
+	if (!(opt & EMBED_TRACE))
 		return;
-	fprintf(out, "[ %4x %4x %4x %2x %2x ]\n", pc-1, instruction, t, rp, sp);
+	fprintf(stderr, "[ %4x %4x %4x %2x %2x ]\n", pc-1, instruction, t, rp, sp);
 }
 
-static int run(forth_t *h, m_t opt, FILE *in, FILE *out, const char *block, cb func, void *param) {
-	assert(h && in && out);
+/* Everything the VM needs is in 'h' and 'o', so separate machines can run
+ * at the same time. With a budget the state is saved when it runs out and
+ * the next call carries on from there. */
+int embed_run(forth_t *h, const embed_opt_t *o) {
+	assert(h && o);
 	static const m_t delta[] = { 0, 1, -2, -1 };
 	const m_t l = cells(h);
 	m_t *const m = h->m, *const vs = h->vs, *const rs = h->rs;
-	m_t pc = h->pc, t = h->t, rp = h->rp, sp = h->sp, cpu = h->cpu, r = 0;
+	m_t pc = h->pc, t = h->t, rp = h->rp, sp = h->sp, cpu = h->cpu, opt = o->options;
+	int r = 0;
+	void *const in = o->in ? o->in : stdin, *const out = o->out ? o->out : stdout;
+	const embed_getc_t get = o->get ? o->get : get_file;
+	const embed_putc_t put = o->put ? o->put : put_file;
+	const char *const block = o->block;
+	const embed_callback_t func = o->callback;
+	void *const param = o->param;
+	const int limited = o->budget != 0;
+	size_t budget = o->budget;
 	for (;;) {
-		const m_t instruction = m[pc++];
-		trace(out, opt, m, pc, instruction, t, rp, sp);
+		if (limited && !budget--) {
+			r = EMBED_EXHAUSTED;
+			goto finished;
+		}
+		const m_t at = pc, instruction = m[pc++];
+		trace(opt, m, pc, instruction, t, rp, sp);
 		if ((r = -!(sp < STK && rp < STK && pc < l))) /* critical error */
 			goto finished;
 		if (0x8000 & instruction) { /* literal */
@@ -134,12 +190,32 @@ static int run(forth_t *h, m_t opt, FILE *in, FILE *out, const char *block, cb f
 			/* 23: UNUSED */
 			/* 24: UNUSED */
 			/* Hosted instructions only */
-			case 25: if (opt & 2) { T = save(h, block, n>>1, ((d_t)T+1)>>1); } break;
-			case 26: if (opt & 2) { T = fputc(t, out); }       break;
-			case 27: if (opt & 2) { T = fgetc(in); }           break;
-			case 28: if (opt & 2) { if (rs[rp % STK]) { rs[rp % STK] = 0; sp--; r = t; t = n; goto finished; }; T = t; } break;
+			case 25: if (opt & 2) { T = embed_save(h, block, n>>1, ((d_t)T+1)>>1, opt); } break;
+			case 26: if (opt & 2) { T = put(t, out); }         break;
+			case 27:
+				if (opt & 2) {
+					const int c = get(in);
+					if (c == EMBED_YIELD) { /* read again on the next call */
+						pc = at;
+						r = c;
+						goto finished;
+					}
+					T = c;
+				}
+				break;
+			case 28: if (opt & 2) { if (rs[rp % STK]) { rs[rp % STK] = 0; sp--; r = (s_t)t; t = n; goto finished; }; T = t; } break;
 			case 29: if (opt & 2) { T = opt; opt = T; } break;
-			case 30: if (opt & 2) { if (func) { T = func(h, param); } else { pc=4; T=21; } }
+			case 30:
+				if (!(opt & 2))
+					break;
+				if (!func) {
+					pc=4; T=21;
+					break;
+				}
+				h->pc = pc, h->t = t, h->rp = rp, h->sp = sp, h->cpu = cpu; /* callbacks may use the stack */
+				T = func(h, param);
+				pc = h->pc, t = h->t, rp = h->rp, sp = h->sp, cpu = h->cpu;
+				break;
 			/* 31: UNUSED */
 			default: if (opt & 2) { pc=4; T=21; } break;
 			}
@@ -163,18 +239,405 @@ static int run(forth_t *h, m_t opt, FILE *in, FILE *out, const char *block, cb f
 		}
 	}
 finished: h->pc = pc, h->t = t, h->rp = rp, h->sp = sp, h->cpu = cpu;
-	return (s_t)r;
+	return r;
+}
+
+/* The native words must do exactly what the Forth they replace in
+ * 'embed.blk' does, odd cases and all, so that the images built with them
+ * are the same as those built without them. */
+#define NATIVE_CALL (0x6000 | (30 << 8) | 0x1C) /* instruction 30 then exit */
+
+static inline m_t byte(const forth_t *h, const m_t a) {
+	return (h->m[(a >> 1) % EMBED_CORE] >> ((a & 1) << 3)) & 0xFFu;
+}
+
+static inline void byte_store(forth_t *h, const m_t a, const m_t c) {
+	m_t *const cell = &h->m[(a >> 1) % EMBED_CORE];
+	const unsigned shift = (a & 1) << 3;
+	*cell = (*cell & ~(0xFFu << shift)) | ((c & 0xFFu) << shift);
+}
+
+static int native_cfetch(forth_t *h) { /* b -- c */
+	embed_push(h, byte(h, embed_pop(h)));
+	return 0;
+}
+
+static int native_count(forth_t *h) { /* b -- b+1 c */
+	const m_t b = embed_pop(h);
+	embed_push(h, b + 1);
+	embed_push(h, byte(h, b));
+	return 0;
+}
+
+static int native_compare(forth_t *h) { /* b1 u1 b2 u2 -- n */
+	const m_t u2 = embed_pop(h), b2 = embed_pop(h), u1 = embed_pop(h), b1 = embed_pop(h);
+	m_t r = u1 - u2;
+	for (m_t i = 0; !r && i < u2; i++) /* the Forth swaps the strings over after each character */
+		r = (i & 1) ? byte(h, b2 + i) - byte(h, b1 + i) : byte(h, b1 + i) - byte(h, b2 + i);
+	embed_push(h, r);
+	return 0;
+}
+
+static int native_search(forth_t *h) { /* b pwd -- 0 | pwd' pwd +-1 : shared by 'find' and 'search-wordlist' */
+	const m_t pwd = embed_pop(h), b = embed_pop(h), u = byte(h, b);
+	for (m_t previous = pwd, w = pwd; w; previous = w, w = h->m[(w >> 1) % EMBED_CORE]) {
+		const m_t name = w + 2;
+		if ((byte(h, name) & 0x9F) != u)
+			continue;
+		m_t i = 0;
+		while (i < u && byte(h, name + 1 + i) == byte(h, b + 1 + i))
+			i++;
+		if (i < u)
+			continue;
+		embed_push(h, previous);
+		embed_push(h, w);
+		embed_push(h, (byte(h, name) & 0x40) ? 1 : -1); /* immediate words give 1 */
+		return 0;
+	}
+	embed_push(h, 0);
+	return 0;
+}
+
+static int native_cmove(forth_t *h) { /* b1 b2 u -- */
+	const m_t u = embed_pop(h), b2 = embed_pop(h), b1 = embed_pop(h);
+	for (m_t i = 0; i < u; i++)
+		byte_store(h, b2 + i, byte(h, b1 + i));
+	return 0;
+}
+
+static int native_fill(forth_t *h) { /* b u c -- */
+	const m_t c = embed_pop(h), u = embed_pop(h), b = embed_pop(h);
+	for (m_t i = 0; i < u; i++)
+		byte_store(h, b + i, c);
+	return 0;
+}
+
+static int native_crc(forth_t *h) { /* b u -- u : CCITT CRC-16, initial value 0xFFFF */
+	const m_t u = embed_pop(h), b = embed_pop(h);
+	m_t crc = 0xFFFF;
+	for (m_t i = 0; i < u; i++) {
+		m_t x = (crc >> 8) ^ byte(h, b + i);
+		x ^= x >> 4;
+		crc = (crc << 8) ^ (x << 12) ^ (x << 5) ^ x;
+	}
+	embed_push(h, crc);
+	return 0;
+}
+
+static int native_umstar(forth_t *h) { /* u u -- ud */
+	const d_t d = (d_t)embed_pop(h) * embed_pop(h);
+	embed_push(h, d);
+	embed_push(h, d >> 16);
+	return 0;
+}
+
+static int native_ummod(forth_t *h) { /* ud u -- rem quot */
+	const m_t u = embed_pop(h), hi = embed_pop(h), lo = embed_pop(h);
+	if (!u)
+		return 10; /* division by zero */
+	if (hi >= u) { /* overflow */
+		embed_push(h, -1);
+		embed_push(h, -1);
+		return 0;
+	}
+	const d_t d = ((d_t)hi << 16) | lo;
+	embed_push(h, d % u);
+	embed_push(h, d / u);
+	return 0;
+}
+
+const embed_native_t embed_natives[] = {
+	{ "c@",              native_cfetch,  0 },
+	{ "count",           native_count,   0 },
+	{ "compare",         native_compare, 0 },
+	{ "search-wordlist", native_search,  1 }, /* a call to the search 'find' uses too */
+	{ "cmove",           native_cmove,   0 },
+	{ "fill",            native_fill,    0 },
+	{ "crc",             native_crc,     0 },
+	{ "um*",             native_umstar,  0 },
+	{ "um/mod",          native_ummod,   0 },
+	{ NULL,              NULL,           0 },
+};
+
+static m_t find(const forth_t *h, const m_t wid, const char *name) { /* code address, or 0 */
+	assert(h && name);
+	const size_t n = strlen(name);
+	m_t last = -1;
+	for (m_t w = h->m[(wid >> 1) % EMBED_CORE]; w && w < last; last = w, w = h->m[(w >> 1) % EMBED_CORE]) {
+		const m_t c = w + 2;
+		size_t i = 0;
+		if ((byte(h, c) & 0x9F) != n)
+			continue;
+		while (i < n && byte(h, c + 1 + i) == (unsigned char)name[i])
+			i++;
+		if (i == n)
+			return ((c + n + 2) >> 1) % EMBED_CORE;
+	}
+	return 0;
+}
+
+static inline int jump(const m_t instruction) { return !(instruction & 0x8000) && (instruction & 0xE000) != 0x6000; }
+
+static int bindable(const forth_t *h, const m_t xt) {
+	const m_t first = h->m[xt];
+	if ((size_t)xt + 1 >= cells(h) || (first & 0xE000) == 0 || (first & 0xE010) == 0x6010)
+		return 0; /* one cell long */
+	for (size_t i = 0; i < cells(h); i++)
+		if (jump(h->m[i]) && (h->m[i] & 0x1FFF) == xt + 1)
+			return 0; /* entered after the first cell */
+	return 1;
+}
+
+int embed_bind(forth_t *h, const m_t wid, const embed_native_t *natives) {
+	assert(h && natives);
+	int r = 0;
+	for (m_t i = 0; natives[i].name; i++) {
+		m_t xt = find(h, wid, natives[i].name);
+		if (xt && natives[i].inner)
+			xt = (h->m[xt] & 0xE000) == 0x4000 ? h->m[xt] & 0x1FFF : 0;
+		if (!xt || !natives[i].word || !bindable(h, xt))
+			continue;
+		h->m[xt]     = 0x8000 | i;
+		h->m[xt + 1] = NATIVE_CALL;
+		r++;
+	}
+	return r;
+}
+
+int embed_native(forth_t *h, void *param) {
+	assert(h && param);
+	const embed_native_t *natives = param;
+	const m_t n = embed_pop(h);
+	size_t length = 0;
+	while (natives[length].name)
+		length++;
+	const int e = n < length && natives[n].word ? natives[n].word(h) : 21;
+	if (e) {
+		h->pc = 4; /* throws the negated number, as unknown instructions do */
+		return e;
+	}
+	return h->t;
+}
+
+#ifndef NO_MAIN
+static void die(const char *fmt, ...) {
+	assert(fmt);
+	va_list arg;
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fputc('\n', stderr);
+	exit(EXIT_FAILURE);
+}
+
+static FILE *fopen_or_die(const char *file, const char *mode) {
+	assert(file && mode);
+	FILE *h = NULL;
+	errno = 0;
+	if (!(h = fopen(file, mode)))
+		die("file open %s (mode %s) failed: %s", file, mode, strerror(errno));
+	return h;
+}
+
+/* Meta-compiling 'embed.fth' from the start each time is slow, so the
+ * machine is saved to a cache file whenever it is about to read a section
+ * rule of the source. Each is keyed by a hash of the VM version, the native
+ * words, the starting machine and all of the text read before it, so a later
+ * run can start from the last one that still matches and only compile what
+ * follows it. Output written before a checkpoint, such as the banner, is not
+ * saved with it and is not printed again when a run resumes from it. */
+#define CACHE_MARK    "\\ ====" /* section rules in 'embed.fth' */
+#define CACHE_MAGIC   (0x454D4243ul) /* "EMBC" */
+#define CACHE_VERSION (1ul) /* increment when the VM or a native word computes something different */
+
+typedef struct {
+	uint64_t key;
+	uint64_t offset; /* characters of input read before 'state' */
+	forth_t state;
+} checkpoint_t;
+
+typedef struct {
+	const char *text;
+	size_t length, position, stop; /* 'get' yields once at 'stop' */
+} source_t;
+
+static uint64_t fnv(uint64_t hash, const void *data, const size_t length) {
+	const uint8_t *p = data;
+	for (size_t i = 0; i < length; i++)
+		hash = (hash ^ p[i]) * 0x100000001B3ull;
+	return hash;
+}
+
+static uint64_t cache_key(const forth_t *h) {
+	assert(h);
+	const uint32_t version = CACHE_VERSION;
+	uint64_t key = fnv(0xCBF29CE484222325ull, &version, sizeof(version));
+	for (size_t i = 0; embed_natives[i].name; i++) {
+		const uint8_t inner = embed_natives[i].inner;
+		key = fnv(key, embed_natives[i].name, strlen(embed_natives[i].name) + 1);
+		key = fnv(key, &inner, sizeof(inner));
+	}
+	return fnv(key, h, sizeof(*h));
+}
+
+static int source_get(void *in) {
+	source_t *s = in;
+	if (s->position == s->stop) {
+		s->stop = SIZE_MAX;
+		return EMBED_YIELD;
+	}
+	return s->position < s->length ? (uint8_t)s->text[s->position++] : EOF;
+}
+
+static char *slurp(const char *name, size_t *length) {
+	assert(name && length);
+	FILE *f = fopen_or_die(name, "rb");
+	size_t size = 0, capacity = 0;
+	char *text = NULL;
+	for (size_t got = 1; got;) {
+		if (size == capacity && !(text = realloc(text, capacity = capacity * 2 + BUFSIZ)))
+			die("embed: out of memory");
+		size += (got = fread(text + size, 1, capacity - size, f));
+	}
+	if (ferror(f))
+		die("file read %s failed", name);
+	fclose(f);
+	*length = size;
+	return text;
+}
+
+static size_t cache_load(const char *name, checkpoint_t *cache, const size_t max) {
+	assert(name && cache);
+	FILE *f = fopen(name, "rb");
+	if (!f)
+		return 0;
+	uint32_t header[3] = { 0 };
+	size_t n = 0;
+	if (fread(header, sizeof(header), 1, f) == 1 && header[0] == CACHE_MAGIC && header[1] == sizeof(forth_t))
+		while (n < max && n < header[2] && fread(&cache[n], sizeof(cache[n]), 1, f) == 1)
+			n++;
+	fclose(f);
+	return n;
+}
+
+static void cache_save(const char *name, const checkpoint_t *cache, const size_t n) {
+	assert(name && cache);
+	char temporary[FILENAME_MAX];
+	snprintf(temporary, sizeof(temporary), "%s.tmp", name);
+	FILE *f = fopen_or_die(temporary, "wb");
+	const uint32_t header[3] = { CACHE_MAGIC, sizeof(forth_t), n };
+	int r = fwrite(header, sizeof(header), 1, f) != 1;
+	if (n)
+		r |= fwrite(cache, sizeof(cache[0]), n, f) != n;
+	r |= fclose(f) < 0;
+#ifdef _WIN32
+	remove(name); /* 'rename' will not replace a file here */
+#endif
+	if (r || rename(temporary, name) < 0)
+		die("cache write %s failed: %s", name, strerror(errno));
+}
+
+/* The natives are bound in the word list that 'forth-wordlist' gives, a
+ * literal followed by an exit. No word list is known to search for it in,
+ * so its header is looked for in the whole image instead. */
+static m_t wordlist(const forth_t *h, const char *name) { /* 0 if not found */
+	assert(h && name);
+	const size_t n = strlen(name);
+	for (size_t c = 2; c + n + 4 < cells(h) * 2; c += 2) {
+		size_t i = 0;
+		if ((byte(h, c) & 0x9F) != n)
+			continue;
+		while (i < n && byte(h, c + 1 + i) == (unsigned char)name[i])
+			i++;
+		const m_t xt = (c + n + 2) >> 1;
+		if (i == n && (h->m[xt] & 0x8000) && (h->m[xt + 1] & 0xE010) == 0x6010)
+			return h->m[xt] & 0x7FFF;
+	}
+	return 0;
 }
 
 int main(int argc, char **argv) {
-	static forth_t h = { .m = { 0 }, .vs = { 0 }, .rs = { 0 } };
-	if (argc > 4)
-		die("usage: %s [in.blk] [out.blk] [file.fth]", argv[0]);
-	if (load(&h, argc < 2 ? "embed.blk" : argv[1]) < 0)
+	forth_t *h = embed_new();
+	if (!h)
+		die("embed: out of memory");
+	if (argc > 5)
+		die("usage: %s [in.blk] [out.hex|out.blk] [file.fth] [file.cache]", argv[0]);
+	const char *image = argc < 2 ? "embed.blk" : argv[1];
+	const int l = embed_load(h, image);
+	if (l == -69)
+		die("file open %s (mode rb) failed: %s", image, strerror(errno));
+	if (l < 0)
 		die("embed: load failed");
-	FILE *in = argc <= 3 ? stdin : fopen_or_die(argv[3], "rb");
-	if (run(&h, 2, in, stdout, argc < 3 ? NULL : argv[2], NULL, NULL))
+	const char *block = argc < 3 ? NULL : argv[2];
+	const size_t length = block ? strlen(block) : 0;
+	const int binary = length >= 4 && !strcmp(block + length - 4, ".blk"); /* which h2 loads with '-n' */
+	const m_t wid = wordlist(h, "forth-wordlist");
+	if (!wid || !embed_bind(h, wid, embed_natives))
+		fprintf(stderr, "embed: no native words bound in %s, running without them\n", image);
+	embed_opt_t o = {
+		.in = stdin, .out = stdout, .block = block, .options = EMBED_HOSTED | (binary ? EMBED_BINARY : 0),
+		.callback = embed_native, .param = (void*)embed_natives,
+	};
+	if (argc <= 3) {
+		if (embed_run(h, &o))
+			die("embed: run failed");
+		return 0;
+	}
+
+	source_t source = { .stop = SIZE_MAX };
+	source.text = slurp(argv[3], &source.length);
+	o.get = source_get, o.in = &source;
+	const char *cache_name = argc > 4 ? argv[4] : NULL;
+	size_t marks = 0, reached = 0, n = 0;
+	for (size_t i = 1; i < source.length; i++)
+		marks += source.text[i - 1] == '\n' && !strncmp(&source.text[i], CACHE_MARK, strlen(CACHE_MARK));
+	checkpoint_t *cache = cache_name && marks ? calloc(marks * 2, sizeof(*cache)) : NULL;
+	size_t *offsets = cache ? calloc(marks, sizeof(*offsets)) : NULL;
+	uint64_t *keys = cache ? calloc(marks, sizeof(*keys)) : NULL;
+	if (cache && (!offsets || !keys))
+		die("embed: out of memory");
+	if (cache) {
+		const size_t old = cache_load(cache_name, cache + marks, marks);
+		uint64_t key = cache_key(h);
+		for (size_t i = 1, j = 0, last = 0; i < source.length; i++) {
+			if (source.text[i - 1] != '\n' || strncmp(&source.text[i], CACHE_MARK, strlen(CACHE_MARK)))
+				continue;
+			key = fnv(key, source.text + last, i - last);
+			offsets[j] = last = i;
+			keys[j++] = key;
+		}
+		for (size_t j = 0; j < marks; j++) {
+			for (size_t k = 0; k < old; k++) {
+				const checkpoint_t *c = &cache[marks + k];
+				if (c->key == keys[j] && c->offset == offsets[j]) {
+					cache[n++] = *c;
+					break;
+				}
+			}
+			if (n != j + 1)
+				break;
+		}
+		if (n) {
+			*h = cache[n - 1].state;
+			source.position = offsets[n - 1];
+			fprintf(stderr, "embed: resuming from %s, %lu of %lu bytes already compiled\n",
+				cache_name, (unsigned long)source.position, (unsigned long)source.length);
+		}
+		reached = n;
+		source.stop = reached < marks ? offsets[reached] : SIZE_MAX;
+	}
+	int r = 0;
+	while ((r = embed_run(h, &o)) == EMBED_YIELD) {
+		checkpoint_t *c = &cache[reached];
+		c->key = keys[reached], c->offset = offsets[reached], c->state = *h;
+		reached++;
+		source.stop = reached < marks ? offsets[reached] : SIZE_MAX;
+	}
+	if (r)
 		die("embed: run failed");
+	if (cache)
+		cache_save(cache_name, cache, reached);
 	return 0; /* exiting takes care of closing files, freeing memory */
 }
+#endif
 
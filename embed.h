@@ -0,0 +1,66 @@
+/* H2 Forth Virtual Machine, Richard James Howe, 2017-2019, MIT License
+ *
+ * The meta-compiler VM as a library, see 'embed.c'. Each 'forth_t' is an
+ * independent machine, so any number of them can be used in one process,
+ * and a machine can be copied once an image has been loaded into it to
+ * avoid loading it again. */
+#ifndef EMBED_H
+#define EMBED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define EMBED_STK       (64)
+#define EMBED_CORE      (32768)
+#define EMBED_TRACE     (1u << 0) /**< print each instruction to stderr */
+#define EMBED_HOSTED    (1u << 1) /**< enable the I/O and callback instructions */
+#define EMBED_BINARY    (1u << 2) /**< save little endian cells, as 'embed.blk' and h2's "nvram.blk" are, not hex */
+#define EMBED_EXHAUSTED (1 << 16) /**< 'embed_run' used up its budget, call it again to continue */
+#define EMBED_YIELD     (1 << 17) /**< from 'get', 'embed_run' stops before the read and returns it */
+
+typedef uint16_t m_t;
+typedef  int16_t s_t;
+typedef uint32_t d_t;
+typedef struct forth_t { m_t m[EMBED_CORE], vs[EMBED_STK], rs[EMBED_STK], pc, t, rp, sp, cpu; } forth_t;
+
+typedef int (*embed_callback_t)(forth_t *h, void *param); /**< result replaces the top of stack */
+typedef int (*embed_getc_t)(void *in);          /**< returns EOF (-1) at the end of input, or EMBED_YIELD */
+typedef int (*embed_putc_t)(int ch, void *out); /**< returns negative on failure */
+
+typedef struct {
+	embed_getc_t get;          /**< 'fgetc' if NULL */
+	void *in;                  /**< passed to 'get', 'stdin' if NULL */
+	embed_putc_t put;          /**< 'fputc' if NULL */
+	void *out;                 /**< passed to 'put', 'stdout' if NULL */
+	const char *block;         /**< file written by 'save', NULL to disallow */
+	embed_callback_t callback; /**< called by instruction 30, NULL to throw */
+	void *param;               /**< passed to 'callback' */
+	unsigned options;          /**< EMBED_TRACE, EMBED_HOSTED and EMBED_BINARY */
+	size_t budget;             /**< instructions per call to 'embed_run', 0 = unlimited */
+} embed_opt_t;
+
+/* Native words are C versions of words in an image; a bound word becomes a
+ * literal, its number in the table, and a call to instruction 30, so
+ * 'embed_native' must be the callback. Words not found keep their Forth. */
+typedef struct {
+	const char *name;        /**< word to replace, NULL ends the table */
+	int (*word)(forth_t *h); /**< 0, or a number the VM negates and throws */
+	int inner;               /**< replace the word 'name' calls first instead */
+} embed_native_t;
+
+extern const embed_native_t embed_natives[]; /**< matches the words in 'embed.blk' */
+
+forth_t *embed_new(void);                /**< an empty machine, NULL on failure */
+forth_t *embed_copy(const forth_t *h);   /**< NULL on failure */
+void embed_free(forth_t *h);
+int embed_load(forth_t *h, const char *name);                          /**< 0 or a negative IOR */
+int embed_load_buffer(forth_t *h, const uint8_t *buffer, size_t length); /**< little endian cells */
+int embed_save(const forth_t *h, const char *name, size_t start, size_t length, unsigned options);
+int embed_run(forth_t *h, const embed_opt_t *o); /**< 0, the VM's result, EMBED_EXHAUSTED or EMBED_YIELD */
+void embed_push(forth_t *h, m_t value); /**< for use within callbacks */
+m_t embed_pop(forth_t *h);
+int embed_bind(forth_t *h, m_t wid, const embed_native_t *natives); /**< number of words bound */
+int embed_native(forth_t *h, void *param); /**< callback, 'param' is the table given to 'embed_bind' */
+
+#endif
@@ -20,6 +20,10 @@
 #include <GL/glut.h>
 #include <GL/freeglut_ext.h> /* for glutStrokeHeight */
 #include <stdarg.h>
+#include <time.h>
+#ifdef __unix__
+#include <pthread.h>
+#endif
 
 #define TRON (0)
 
@@ -34,13 +38,8 @@
 #define Y_MAX            (100.0)
 #define Y_MIN            (0.0)
 #define LINE_WIDTH       (0.5)
-#define CYCLE_MODE_FIXED (false)
-#define CYCLE_INITIAL    (100000)
-#define CYCLE_INCREMENT  (10000)
-#define CYCLE_DECREMENT  (500)
-#define CYCLE_MINIMUM    (10000)
-#define CYCLE_HYSTERESIS (2.0)
-#define TARGET_FPS       (30.0)
+#define SIMULATION_CYCLES (10000) /* instructions run between polling for input */
+#define SNAPSHOT_PERIOD   (0.010) /* seconds between snapshots handed to the renderer */
 #define BACKGROUND_ON    (false)
 #define SIM_HACKS        (true)
 #define TRACE_FILE       ("trace.csv")
@@ -54,8 +53,6 @@ typedef struct {
 	double window_scale_x;
 	double window_scale_y;
 	void *font_scaled;
-	uint64_t cycle_count;
-	uint64_t cycles;
 	volatile unsigned tick;
 	unsigned arena_tick_ms;
 	volatile bool halt_simulation;
@@ -63,6 +60,7 @@ typedef struct {
 	bool debug_extra;
 	bool step;
 	bool debug_mode;
+	double tick_rate;
 } world_t;
 
 static world_t world = {
@@ -79,8 +77,6 @@ static world_t world = {
 	.debug_extra                 = false,
 	.step                        = false,
 	.debug_mode                  = false,
-	.cycle_count                 = 0,
-	.cycles                      = CYCLE_INITIAL,
 	.font_scaled                 = GLUT_STROKE_MONO_ROMAN
 };
 
@@ -261,14 +257,12 @@ static scale_t font_attributes(void) {
 static void draw_vt100_char(
 		const double x, const double y, 
 		const double scale_x, const double scale_y, 
-		const double orientation, const uint8_t c, 
-		const vt100_attribute_t *attr, const bool blink) {
-	assert(attr);
+		const double orientation, const uint16_t cell, const bool blink) {
 	/*scale_t scale = font_attributes();
 	double char_width  = scale.x / X_MAX;
        	double char_height = scale.y / Y_MAX;*/
 
-	if (blink && attr->blink)
+	if (blink && (cell & VT100_CELL_BLINK))
 		return;
 
 	glMatrixMode(GL_MODELVIEW);
@@ -277,24 +271,24 @@ static void draw_vt100_char(
 		glTranslatef(x, y, 0.0);
 		glScaled(scale_x, scale_y, 1.0);
 		glRotated(rad2deg(orientation), 0, 0, 1);
-		set_color(attr->foreground_color, attr->bold);
-		draw_char(attr->conceal ? '*' : c);
+		set_color(VT100_CELL_FOREGROUND(cell), !!(cell & VT100_CELL_BOLD));
+		draw_char(VT100_CELL_CHARACTER(cell));
 		glEnd();
 	glPopMatrix();
 	if (BACKGROUND_ON)
-		draw_rectangle_filled(x, y, 1.20, 1.55, attr->background_color);
+		draw_rectangle_filled(x, y, 1.20, 1.55, VT100_CELL_BACKGROUND(cell));
 }
 
 static int draw_vt100_block(
 		const double x, const double y, 
 		const double scale_x, const double scale_y, 
-		const double orientation, const uint8_t *msg, 
-		const size_t len, const vt100_attribute_t * const attr, const bool blink) {
-	assert(attr);
+		const double orientation, const uint16_t *cells,
+		const size_t len, const bool blink) {
+	assert(cells);
 	const scale_t scale = font_attributes();
 	const double char_width = (scale.x / X_MAX)*1.1;
 	for (size_t i = 0; i < len; i++)
-		draw_vt100_char(x+char_width*i, y, scale_x, scale_y, orientation, msg[i], &attr[i], blink);
+		draw_vt100_char(x+char_width*i, y, scale_x, scale_y, orientation, cells[i], blink);
 	return len;
 }
 
@@ -577,44 +571,75 @@ typedef struct {
 } vt100_background_texture_t;
 
 typedef struct {
-	uint64_t blink_count;
 	double x;
 	double y;
 	bool blink_on;
+	bool blink_drawn;    /**< blink phase the cached rows were rendered in */
+	GLuint rows;         /**< display lists caching each rendered row, zero until first drawn */
+	GLfloat *vertices, *coordinates; /**< glyph atlas quads, built on first use */
+	GLubyte *colors;
 	color_t color;
 	vt100_t vt100;
 	vt100_background_texture_t *texture;
 } terminal_t;
 
-static void texture_background(const terminal_t * const t) {
+/* Each terminal owns one texture holding its background colours, stored top
+ * row first. Terminal row 'y' covers a band of texture rows, only the bands of
+ * damaged rows are repainted and uploaded again. */
+static void texture_background(const terminal_t * const t, const unsigned y) {
 	assert(t);
 	const vt100_background_texture_t *v = t->texture;
 	const vt100_t *vt = &t->vt100;
-	uint8_t *const img = v->image;
 	const unsigned h = v->height;
 	const unsigned w = v->width;
-
-	for (unsigned i = 0; i < h; i++) {
-		uint8_t * const row = &img[i * 4];
-		const unsigned ii = ((h - i - 1) * vt->height) / h;
-		for (unsigned j = 0; j < w; j++) {
-			uint8_t * const column = &row[j * h * 4];
-			const unsigned jj = (vt->width * j) / w;
-			const unsigned idx = jj + (ii * vt->width);
-			column[0] = 255 * (vt->attributes[idx].background_color & 1);
-			column[1] = 255 * (vt->attributes[idx].background_color & 2);
-			column[2] = 255 * (vt->attributes[idx].background_color & 4);
-			column[3] = 255;
-		}
+	const unsigned first = ((y * h) + vt->height - 1) / vt->height;
+	const unsigned last  = (((y + 1) * h) + vt->height - 1) / vt->height;
+	const uint16_t *const cells = vt100_row(vt, y);
+	uint8_t *const img = &v->image[first * w * 4];
+
+	for (unsigned j = 0; j < w; j++) {
+		uint8_t * const column = &img[j * 4];
+		const unsigned background = VT100_CELL_BACKGROUND(cells[(vt->width * j) / w]);
+		column[0] = 255 * (background & 1);
+		column[1] = 255 * (background & 2);
+		column[2] = 255 * (background & 4);
+		column[3] = 255;
 	}
+	for (unsigned i = first + 1; i < last; i++)
+		memcpy(&v->image[i * w * 4], img, w * 4);
+	if (last > first)
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, w, last - first, GL_RGBA, GL_UNSIGNED_BYTE, img);
 }
 
-/* See <http://www.glprogramming.com/red/chapter09.html> */
-static void draw_texture(const terminal_t * const t, const bool update) {
+static void texture_update(const terminal_t * const t) {
 	assert(t);
 	vt100_background_texture_t *v = t->texture;
 	if (!v)
 		return;
+	const bool created = !v->name;
+	if (created) {
+		glGenTextures(1, &v->name);
+		glBindTexture(GL_TEXTURE_2D, v->name);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, v->width, v->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	} else {
+		glBindTexture(GL_TEXTURE_2D, v->name);
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (unsigned y = 0; y < t->vt100.height; y++)
+		if (created || vt100_row_dirty(&t->vt100, y))
+			texture_background(t, y);
+}
+
+/* See <http://www.glprogramming.com/red/chapter09.html> */
+static void draw_texture(const terminal_t * const t) {
+	assert(t);
+	const vt100_background_texture_t *v = t->texture;
+	if (!v || !v->name)
+		return;
 
 	const scale_t scale = font_attributes();
 	const double char_width  = scale.x / X_MAX;
@@ -627,33 +652,137 @@ static void draw_texture(const terminal_t * const t, const bool update) {
 	glEnable(GL_TEXTURE_2D);
 	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
 
-	if (update) {
-		glClearColor (0.0, 0.0, 0.0, 0.0);
-		glShadeModel(GL_FLAT);
-		glEnable(GL_DEPTH_TEST);
+	glBindTexture(GL_TEXTURE_2D, v->name);
+	glMatrixMode(GL_MODELVIEW);
+	glBegin(GL_QUADS);
+		glTexCoord2f(0.0, 0.0); glVertex3f(x,       y+height, 0.0);
+		glTexCoord2f(1.0, 0.0); glVertex3f(x+width, y+height, 0.0);
+		glTexCoord2f(1.0, 1.0); glVertex3f(x+width, y,        0.0);
+		glTexCoord2f(0.0, 1.0); glVertex3f(x,       y,        0.0);
+	glEnd();
+	glDisable(GL_TEXTURE_2D);
+}
+
+/* The hardware font ROM (see 'font.bin' and 'fonts/readme.md') holds two
+ * fonts of 256 glyphs, each glyph is 12 lines of 8 pixels stored as text. The
+ * first font is copied into a texture atlas of 16 by 16 glyphs so a whole
+ * terminal can be drawn as one batch of textured quads, which also gives the
+ * GUI the same look as the real display. Without the file the GLUT stroke
+ * font is used instead. */
+#define FONT_FILE     VGA_FONT_FILE
+#define FONT_WIDTH    VGA_FONT_WIDTH
+#define FONT_HEIGHT   VGA_FONT_HEIGHT
+#define FONT_GLYPHS   VGA_FONT_GLYPHS
+#define ATLAS_COLUMNS (16)
+#define ATLAS_WIDTH   (FONT_WIDTH * ATLAS_COLUMNS)
+#define ATLAS_HEIGHT  (256) /* 16 rows of glyphs rounded up to a power of two */
 
-		texture_background(t);
-		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+typedef struct {
+	GLuint name;
+	bool loaded;
+	uint8_t image[ATLAS_WIDTH * ATLAS_HEIGHT];
+} font_atlas_t;
 
-		glGenTextures(1, &v->name);
-		glBindTexture(GL_TEXTURE_2D, v->name);
+static font_atlas_t atlas = { .name = 0, .loaded = false };
 
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, v->width, v->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, v->image);
+static int atlas_load(const char *file) {
+	assert(file);
+	static uint8_t glyphs[FONT_GLYPHS][FONT_HEIGHT];
+	if (h2_font_load(file, glyphs) < 0)
+		return -1;
+	for (size_t glyph = 0; glyph < FONT_GLYPHS; glyph++)
+		for (size_t y = 0; y < FONT_HEIGHT; y++) {
+			uint8_t *const row = &atlas.image[(((glyph / ATLAS_COLUMNS) * FONT_HEIGHT) + y) * ATLAS_WIDTH];
+			for (size_t x = 0; x < FONT_WIDTH; x++)
+				row[((glyph % ATLAS_COLUMNS) * FONT_WIDTH) + x] = (glyphs[glyph][y] << x) & 0x80 ? 255 : 0;
+		}
+	atlas.loaded = true;
+	return 0;
+}
+
+static void atlas_texture(void) {
+	assert(atlas.loaded);
+	if (atlas.name)
+		return;
+	glGenTextures(1, &atlas.name);
+	glBindTexture(GL_TEXTURE_2D, atlas.name);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, ATLAS_WIDTH, ATLAS_HEIGHT, 0, GL_ALPHA, GL_UNSIGNED_BYTE, atlas.image);
+}
+
+/* rebuild the quads of logical row 'y', four vertices per cell */
+static void atlas_row(terminal_t *t, const unsigned y, const double char_width, const double char_height) {
+	assert(t);
+	const vt100_t *const v = &t->vt100;
+	const uint16_t *const cells = vt100_row(v, y);
+	const double top = t->y - ((double)y * char_height);
+	for (unsigned x = 0; x < v->width; x++) {
+		const size_t i = ((size_t)y * v->width) + x;
+		GLfloat *const p = &t->vertices[i * 8], *const c = &t->coordinates[i * 8];
+		GLubyte *const k = &t->colors[i * 16];
+		const uint16_t cell = cells[x];
+		const unsigned glyph = VT100_CELL_CHARACTER(cell);
+		const GLfloat x0 = t->x + (char_width * x), x1 = x0 + char_width;
+		const GLfloat y0 = top, y1 = top + char_height;
+		const GLfloat u0 = (GLfloat)((glyph % ATLAS_COLUMNS) * FONT_WIDTH) / ATLAS_WIDTH;
+		const GLfloat u1 = u0 + ((GLfloat)FONT_WIDTH / ATLAS_WIDTH);
+		const GLfloat t0 = (GLfloat)((glyph / ATLAS_COLUMNS) * FONT_HEIGHT) / ATLAS_HEIGHT;
+		const GLfloat t1 = t0 + ((GLfloat)FONT_HEIGHT / ATLAS_HEIGHT);
+		const GLfloat quad[8]   = { x0, y0, x1, y0, x1, y1, x0, y1 };
+		const GLfloat coord[8]  = { u0, t1, u1, t1, u1, t0, u0, t0 };
+		memcpy(p, quad, sizeof(quad));
+		memcpy(c, coord, sizeof(coord));
+
+		const unsigned foreground = VT100_CELL_FOREGROUND(cell);
+		const GLubyte on = (cell & VT100_CELL_BOLD) ? 204 : 102; /* see 'set_color' */
+		const GLubyte alpha = (t->blink_on && (cell & VT100_CELL_BLINK)) ? 0 : 255;
+		for (size_t j = 0; j < 4; j++) {
+			k[(j * 4) + 0] = foreground & 1 ? on : 0;
+			k[(j * 4) + 1] = foreground & 2 ? on : 0;
+			k[(j * 4) + 2] = foreground & 4 ? on : 0;
+			k[(j * 4) + 3] = alpha;
+		}
 	}
+}
 
-	glBindTexture(GL_TEXTURE_2D, v->name);
+static void atlas_draw(terminal_t *t, const bool all, const double char_width, const double char_height) {
+	assert(t);
+	const vt100_t *const v = &t->vt100;
+	if (!t->vertices) {
+		t->vertices    = allocate_or_die(sizeof(t->vertices[0])    * v->size * 8);
+		t->coordinates = allocate_or_die(sizeof(t->coordinates[0]) * v->size * 8);
+		t->colors      = allocate_or_die(sizeof(t->colors[0])      * v->size * 16);
+	}
+	for (unsigned y = 0; y < v->height; y++)
+		if (all || vt100_row_dirty(v, y)) /* only damaged rows are rebuilt */
+			atlas_row(t, y, char_width, char_height);
+
+	atlas_texture();
 	glMatrixMode(GL_MODELVIEW);
-	glBegin(GL_QUADS);
-		glTexCoord2f(1.0, 0.0); glVertex3f(x,       y+height, 0.0);
-		glTexCoord2f(1.0, 1.0); glVertex3f(x+width, y+height, 0.0);
-		glTexCoord2f(0.0, 1.0); glVertex3f(x+width, y,        0.0);
-		glTexCoord2f(0.0, 0.0); glVertex3f(x,       y,        0.0);
-	glEnd();
+	glPushMatrix();
+	glLoadIdentity();
+	glEnable(GL_TEXTURE_2D);
+	glEnable(GL_ALPHA_TEST); /* unlit pixels must not hide the background */
+	glAlphaFunc(GL_GREATER, 0.5);
+	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+	glBindTexture(GL_TEXTURE_2D, atlas.name);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glVertexPointer(2, GL_FLOAT, 0, t->vertices);
+	glTexCoordPointer(2, GL_FLOAT, 0, t->coordinates);
+	glColorPointer(4, GL_UNSIGNED_BYTE, 0, t->colors);
+	glDrawArrays(GL_QUADS, 0, (GLsizei)(v->size * 4));
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisable(GL_ALPHA_TEST);
 	glDisable(GL_TEXTURE_2D);
+	glPopMatrix();
 }
 
 void draw_terminal(const world_t *world, terminal_t *t, const char * const name) {
@@ -666,24 +795,37 @@ void draw_terminal(const world_t *world, terminal_t *t, const char * const name)
 	static const double scale_y = 0.011;
 	const vt100_t * const v = &t->vt100;
 	const scale_t scale = font_attributes();
-	const double now = world->tick - t->blink_count;
 	const double char_width  = scale.x / X_MAX;
        	const double char_height = scale.y / Y_MAX;
 	const size_t cursor_x = v->cursor % v->width;
 	const size_t cursor_y = v->cursor / v->width;
 
-	if (now > seconds_to_ticks(world, 1.0)) {
-		t->blink_on = !(t->blink_on);
-		t->blink_count = world->tick;
-	}
+	t->blink_on = (unsigned)(world->tick / seconds_to_ticks(world, 1.0)) & 1;
 
 	/**@note the cursor is deliberately in a different position compared to draw_vga(), due to how the VGA cursor behaves in hardware */
 	if ((!(v->blinks) || t->blink_on) && v->cursor_on) /* fudge factor of 1.10? */
 		draw_rectangle_filled(t->x + (char_width * 1.10 * (cursor_x)) , t->y - (char_height * cursor_y), char_width, char_height, WHITE);
 
 
-	for (size_t i = 0; i < t->vt100.height; i++)
-		draw_vt100_block(t->x, t->y - ((double)i * char_height), scale_x, scale_y, 0, v->m + (i*v->width), v->width, v->attributes + (i*v->width), t->blink_on);
+	if (atlas.loaded) {
+		atlas_draw(t, !t->vertices || t->blink_drawn != t->blink_on, char_width * 1.10, char_height);
+	} else {
+		const bool all = !t->rows || t->blink_drawn != t->blink_on;
+		if (!t->rows)
+			t->rows = glGenLists(v->height);
+		assert(t->rows);
+		for (size_t i = 0; i < v->height; i++) {
+			if (all || vt100_row_dirty(v, i)) { /* only damaged rows are rendered again */
+				glNewList(t->rows + i, GL_COMPILE);
+				draw_vt100_block(t->x, t->y - ((double)i * char_height), scale_x, scale_y, 0, vt100_row(v, i), v->width, t->blink_on);
+				glEndList();
+			}
+			glCallList(t->rows + i);
+		}
+	}
+	texture_update(t);
+	vt100_clean(&t->vt100);
+	t->blink_drawn = t->blink_on;
 	draw_string_scaled(t->x, t->y - (v->height * char_height), scale_x, scale_y, 0, name, t->color);
 
 	/* fudge factor = 1/((1/scale_x)/X_MAX) ??? */
@@ -758,7 +900,6 @@ static vt100_background_texture_t vga_background_texture = {
 };
 
 static terminal_t vga_terminal = {
-	.blink_count = 0,
 	.x           = X_MIN + 2.0,
 	.y           = Y_MAX - 8.0,
 	.color       = GREEN,  /* WHITE */
@@ -775,9 +916,8 @@ static terminal_t vga_terminal = {
 		.blinks       = false,
 		.n1           = 1,
 		.n2           = 1,
-		.m            = { 0 },
 		.attribute    = { 0 },
-		.attributes   = { { 0 } },
+		.cells        = { 0 },
 	},
 	.texture = &vga_background_texture
 };
@@ -808,7 +948,6 @@ static vt100_background_texture_t uart_background_texture = {
 };
 
 static terminal_t uart_terminal = {
-	.blink_count = 0,
 	.x           = X_MIN + 2.0,
 	.y           = Y_MIN + 28.5,
 	.color       = BLUE,
@@ -825,15 +964,15 @@ static terminal_t uart_terminal = {
 		.n1           = 1,
 		.n2           = 1,
 		.blinks      = false,
-		.m            = { 0 },
 		.attribute    = { 0 },
-		.attributes   = { { 0 } },
+		.cells        = { 0 },
 	},
 	.texture = &uart_background_texture
 };
 
 static h2_t *h = NULL;
 static h2_io_t *h2_io = NULL;
+static h2_console_t *uart_console = NULL; /* set when the UART is bridged to the host */
 static fifo_t *uart_rx_fifo = NULL;
 static fifo_t *uart_tx_fifo = NULL;
 static fifo_t *ps2_rx_fifo = NULL;
@@ -842,104 +981,254 @@ static fifo_t *ps2_rx_fifo = NULL;
 
 /* ====================================== H2 I/O Handling ====================================== */
 
-static uint16_t h2_io_get_gui(h2_soc_state_t * const soc, const uint16_t addr, bool *debug_on) {
+/* The GUI only overrides the registers attached to its widgets and FIFOs, the
+ * rest are the defaults registered by 'h2_io_new' */
+
+static uint16_t h2_io_get_uart_gui(h2_soc_state_t * const soc, const uint16_t addr, bool *debug_on, void *param) {
 	assert(soc);
-	assert(ps2_rx_fifo);
 	assert(uart_tx_fifo);
 	assert(uart_rx_fifo);
+	UNUSED(addr);
+	UNUSED(param);
+	if (debug_on)
+		*debug_on = false;
+	return (fifo_is_empty(uart_tx_fifo) << UART_TX_FIFO_EMPTY_BIT)
+		| (fifo_is_full(uart_tx_fifo)  << UART_TX_FIFO_FULL_BIT)
+		| (fifo_is_empty(uart_rx_fifo) << UART_RX_FIFO_EMPTY_BIT)
+		| (fifo_is_full(uart_rx_fifo)  << UART_RX_FIFO_FULL_BIT)
+		| soc->uart_getchar_register;
+}
 
+static uint16_t h2_io_get_vt100_gui(h2_soc_state_t * const soc, const uint16_t addr, bool *debug_on, void *param) {
+	assert(soc);
+	assert(ps2_rx_fifo);
+	UNUSED(addr);
+	UNUSED(param);
 	if (debug_on)
 		*debug_on = false;
-	switch (addr) {
-	case iUart:
-		return (fifo_is_empty(uart_tx_fifo) << UART_TX_FIFO_EMPTY_BIT)
-			| (fifo_is_full(uart_tx_fifo)  << UART_TX_FIFO_FULL_BIT)
-			| (fifo_is_empty(uart_rx_fifo) << UART_RX_FIFO_EMPTY_BIT)
-			| (fifo_is_full(uart_rx_fifo)  << UART_RX_FIFO_FULL_BIT)
-			| soc->uart_getchar_register;
-	case iVT100:
-		return (1u << UART_TX_FIFO_EMPTY_BIT)
-			| (0u << UART_TX_FIFO_FULL_BIT)
-			| (fifo_is_empty(ps2_rx_fifo) << UART_RX_FIFO_EMPTY_BIT)
-			| (fifo_is_full(ps2_rx_fifo)  << UART_RX_FIFO_FULL_BIT)
-			| soc->ps2_getchar_register;
-	case iSwitches:
-		return soc->switches;
-	case iTimerDin: return soc->timer;
-	case iMemDin:   return h2_io_memory_read_operation(soc);
-	default:
-		warning("invalid read from %04"PRIx16, addr);
-		break;
-	}
-	return 0;
+	return (1u << UART_TX_FIFO_EMPTY_BIT)
+		| (0u << UART_TX_FIFO_FULL_BIT)
+		| (fifo_is_empty(ps2_rx_fifo) << UART_RX_FIFO_EMPTY_BIT)
+		| (fifo_is_full(ps2_rx_fifo)  << UART_RX_FIFO_FULL_BIT)
+		| soc->ps2_getchar_register;
 }
 
-static void h2_io_set_gui(h2_soc_state_t *soc, const uint16_t addr, const uint16_t value, bool *debug_on) {
+static void h2_io_set_uart_gui(h2_soc_state_t * const soc, const uint16_t addr, const uint16_t value, bool *debug_on, void *param) {
 	assert(soc);
 	assert(uart_tx_fifo);
 	assert(uart_rx_fifo);
+	UNUSED(addr);
+	UNUSED(param);
+	if (debug_on)
+		*debug_on = false;
+	if (value & UART_TX_WE) {
+		fifo_push(uart_tx_fifo, value);
+	}
+	if (value & UART_RX_RE) {
+		uint8_t c = 0;
+		fifo_pop(uart_rx_fifo, &c);
+		soc->uart_getchar_register = c;
+	}
+}
 
+static void h2_io_set_vt100_gui(h2_soc_state_t * const soc, const uint16_t addr, const uint16_t value, bool *debug_on, void *param) {
+	assert(soc);
+	assert(ps2_rx_fifo);
+	UNUSED(addr);
+	UNUSED(param);
 	if (debug_on)
 		*debug_on = false;
+	if (value & UART_TX_WE)
+		h2_terminal_put(soc, value & 0xff);
+	if (value & UART_RX_RE) {
+		uint8_t c = 0;
+		fifo_pop(ps2_rx_fifo, &c);
+		soc->ps2_getchar_register = c;
+	}
+}
 
-	switch (addr) {
-	case oUart:
-		if (value & UART_TX_WE) {
-			fifo_push(uart_tx_fifo, value);
-		}
-		if (value & UART_RX_RE) {
-			uint8_t c = 0;
-			fifo_pop(uart_rx_fifo, &c);
-			soc->uart_getchar_register = c;
+static void h2_io_set_leds_gui(h2_soc_state_t * const soc, const uint16_t addr, const uint16_t value, bool *debug_on, void *param) {
+	assert(soc);
+	UNUSED(addr);
+	UNUSED(param);
+	if (debug_on)
+		*debug_on = false;
+	soc->leds = value;
+}
+
+static void h2_io_set_7_segments_gui(h2_soc_state_t * const soc, const uint16_t addr, const uint16_t value, bool *debug_on, void *param) {
+	assert(soc);
+	UNUSED(addr);
+	UNUSED(param);
+	if (debug_on)
+		*debug_on = false;
+	soc->led_7_segments = value;
+}
+
+static void h2_io_gui(h2_io_t * const io) {
+	assert(io);
+	h2_io_register_input(io,  iUart,    h2_io_get_uart_gui,       NULL);
+	h2_io_register_input(io,  iVT100,   h2_io_get_vt100_gui,      NULL);
+	h2_io_register_output(io, oUart,    h2_io_set_uart_gui,       NULL);
+	h2_io_register_output(io, oVT100,   h2_io_set_vt100_gui,      NULL);
+	h2_io_register_output(io, oLeds,    h2_io_set_leds_gui,       NULL);
+	h2_io_register_output(io, o7SegLED, h2_io_set_7_segments_gui, NULL);
+}
+
+/* ====================================== H2 I/O Handling ====================================== */
+
+/* ====================================== Simulation Thread ==================================== */
+
+/* The H2 and its SoC run on their own thread (where threads are available),
+ * so the simulation speed no longer depends on how fast the scene can be
+ * drawn. Key presses reach it through the lock-free UART and PS/2 FIFOs and
+ * the switches through a single word. In the other direction the simulation
+ * publishes snapshots of everything drawn through a triple buffer, the
+ * simulation always owns one slot and the renderer another, the third is
+ * swapped between them with one atomic exchange. */
+
+typedef struct {
+	uint16_t leds, led_7_segments, switches;
+	uint16_t timer_control, timer, irc_mask;
+	uint16_t mem_control, mem_addr_low, mem_dout;
+	bool wait, interrupt;
+	uint8_t interrupt_selector;
+	unsigned flash_we, flash_cs, flash_mode, flash_status, flash_cycle;
+	uint32_t flash_arg1_address;
+	uint16_t flash_data;
+	uint16_t uart_tx_baud, uart_rx_baud, uart_control;
+} soc_registers_t;
+
+typedef struct {
+	h2_t cpu;
+	soc_registers_t soc;
+	vt100_t vga;
+	uint64_t cycles;
+} snapshot_t;
+
+#define SNAPSHOT_FRESH (4u) /* set on the shared index when it holds an unread snapshot */
+
+static snapshot_t snapshots[3];
+static unsigned snapshot_shared = 1; /* index | SNAPSHOT_FRESH, swapped atomically */
+static unsigned snapshot_back   = 0; /* written only by the simulation */
+static unsigned snapshot_front  = 2; /* read only by the renderer */
+static unsigned input_switches  = 0; /* switches and D-Pad, written by the renderer */
+static uint64_t simulation_cycles = 0;
+
+#ifdef __unix__
+static pthread_t simulation_thread;
+static bool simulation_threaded = false;
+#endif
+
+static void snapshot_publish(void) {
+	snapshot_t *const s = &snapshots[snapshot_back];
+	h2_terminal_sync(h2_io->soc);
+	const h2_soc_state_t *const soc = h2_io->soc;
+	s->cpu = *h;
+	s->vga = soc->vt100;
+	s->cycles = simulation_cycles;
+	soc_registers_t *const r = &s->soc;
+	r->leds               = soc->leds;
+	r->led_7_segments     = soc->led_7_segments;
+	r->switches           = soc->switches;
+	r->timer_control      = soc->timer_control;
+	r->timer              = soc->timer;
+	r->irc_mask           = soc->irc_mask;
+	r->mem_control        = soc->mem_control;
+	r->mem_addr_low       = soc->mem_addr_low;
+	r->mem_dout           = soc->mem_dout;
+	r->wait               = soc->wait;
+	r->interrupt          = soc->interrupt;
+	r->interrupt_selector = soc->interrupt_selector;
+	r->flash_we           = soc->flash.we;
+	r->flash_cs           = soc->flash.cs;
+	r->flash_mode         = soc->flash.mode;
+	r->flash_status       = soc->flash.status;
+	r->flash_cycle        = soc->flash.cycle;
+	r->flash_arg1_address = soc->flash.arg1_address;
+	r->flash_data         = soc->flash.data;
+	r->uart_tx_baud       = soc->uart_tx_baud;
+	r->uart_rx_baud       = soc->uart_rx_baud;
+	r->uart_control       = soc->uart_control;
+	snapshot_back = H2_EXCHANGE(&snapshot_shared, snapshot_back | SNAPSHOT_FRESH) & ~SNAPSHOT_FRESH;
+}
+
+/* returns the latest snapshot, and if it is new copies its VGA terminal into
+ * the one drawn, rows that differ from what was there are marked as damaged */
+static const snapshot_t *snapshot_take(void) {
+	if (H2_LOAD_ACQUIRE(&snapshot_shared) & SNAPSHOT_FRESH) {
+		snapshot_front = H2_EXCHANGE(&snapshot_shared, snapshot_front) & ~SNAPSHOT_FRESH;
+		const vt100_t *const n = &snapshots[snapshot_front].vga;
+		vt100_t *const v = &vga_terminal.vt100;
+		bool changed[VT100_MAX_ROWS] = { false };
+		uint32_t dirty[sizeof(v->dirty)/sizeof(v->dirty[0])];
+		for (unsigned y = 0; y < n->height; y++)
+			changed[y] = y >= v->height || v->width != n->width
+				|| memcmp(vt100_row(v, y), vt100_row(n, y), n->width * sizeof(uint16_t));
+		memcpy(dirty, v->dirty, sizeof(dirty));
+		*v = *n;
+		memcpy(v->dirty, dirty, sizeof(dirty));
+		for (unsigned y = 0; y < v->height; y++)
+			if (changed[y])
+				vt100_damage(v, y, y);
+	}
+	return &snapshots[snapshot_front];
+}
+
+/* run the simulation for a while, false if it is paused */
+static bool simulation_step(void) {
+	unsigned long increment = SIMULATION_CYCLES;
+	h2_io->soc->switches = H2_LOAD_RELAXED(&input_switches);
+	if (H2_LOAD_RELAXED(&world.debug_mode)) {
+		increment = 0;
+		if (H2_LOAD_ACQUIRE(&world.step)) {
+			H2_STORE_RELAXED(&world.step, false);
+			increment = 1;
 		}
-		break;
-	case oVT100:
-		if (value & UART_TX_WE) {
-			vt100_update(&vga_terminal.vt100, value & 0xff);
-			vt100_update(&soc->vt100, value & 0xff);
+	}
+	if (!increment)
+		return false;
+	if (h2_run(h, h2_io, stderr, increment, NULL, false, trace_file) < 0)
+		H2_STORE_RELEASE(&world.halt_simulation, true);
+	simulation_cycles += increment;
+	return true;
+}
+
+#ifdef __unix__
+/* H2_PACE holds the ratio of emulated to wall clock time, for example "1" for
+ * the 100MHz of the board, without it the simulation runs flat out */
+static void *simulation(void *unused) {
+	UNUSED(unused);
+	double published = 0.;
+	h2_pace_t pace;
+	const double ratio = getenv("H2_PACE") ? strtod(getenv("H2_PACE"), NULL) : 0.;
+	bool paced = false;
+	while (!H2_LOAD_ACQUIRE(&world.halt_simulation)) {
+		const bool ran = simulation_step();
+		if (ratio > 0.) {
+			if (!paced) /* start again after a pause, time spent paused is not lost */
+				h2_pace_start(&pace, ratio, simulation_cycles);
+			else
+				h2_pace(&pace, simulation_cycles);
+			paced = ran;
 		}
-		if (value & UART_RX_RE) {
-			uint8_t c = 0;
-			fifo_pop(ps2_rx_fifo, &c);
-			soc->ps2_getchar_register = c;
+		const double now = wall_clock_seconds();
+		if ((now - published) >= SNAPSHOT_PERIOD) {
+			snapshot_publish();
+			published = now;
 		}
-		break;
-	case oLeds:
-		soc->leds          = value;
-		for (size_t i = 0; i < LEDS_COUNT; i++)
-			leds[i].on = value & (1 << i);
-		break;
-	case oTimerCtrl:
-		soc->timer_control  = value;
-		break;
-	case o7SegLED:
-		for (size_t i = 0; i < SEGMENT_COUNT; i++)
-			segments[i].segment = (value >> ((SEGMENT_COUNT - i - 1) * 4)) & 0xf;
-		soc->led_7_segments = value;
-		break;
-	case oIrcMask:    soc->irc_mask     = value; break;
-	case oMemControl:
-		{
-			soc->mem_control    = value;
-			const bool sram_cs  = soc->mem_control & SRAM_CHIP_SELECT;
-			const bool oe       = soc->mem_control & FLASH_MEMORY_OE;
-			const bool we       = soc->mem_control & FLASH_MEMORY_WE;
-			if (sram_cs && !oe && we)
-				soc->vram[(((uint32_t)(soc->mem_control & FLASH_MASK_ADDR_UPPER_MASK) << 16) | soc->mem_addr_low) >> 1] = soc->mem_dout;
-			break;
+		if (!ran) {
+			struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000l };
+			nanosleep(&ts, NULL);
 		}
-	case oMemAddrLow:  soc->mem_addr_low = value; break;
-	case oMemDout:     soc->mem_dout     = value; break;
-	case oUartTxBaud:  soc->uart_tx_baud = value; break;
-	case oUartRxBaud:  soc->uart_rx_baud = value; break;
-	case oUartControl: soc->uart_control = value; break;
-	default:
-		warning("invalid write to %04"PRIx16 ":%04"PRIx16, addr, value);
-		break;
 	}
+	snapshot_publish();
+	return NULL;
 }
+#endif
+
+/* ====================================== Simulation Thread ==================================== */
 
-/* ====================================== H2 I/O Handling ====================================== */
 
 /* ====================================== Main Loop ============================================ */
 
@@ -956,7 +1245,7 @@ static double fps(void) {
 	return fps;
 }
 
-static void draw_debug_info(const world_t *world, double fps, double x, double y) {
+static void draw_debug_info(const world_t *world, const snapshot_t *snapshot, double fps, double x, double y) {
 	textbox_t t = { .x = x, .y = y, .draw_border = true, .color_text = WHITE, .color_box = WHITE };
 	assert(world);
 	fifo_t *f = world->use_uart_input ? uart_rx_fifo : ps2_rx_fifo;
@@ -964,7 +1253,7 @@ static void draw_debug_info(const world_t *world, double fps, double x, double y
 
 	fill_textbox(&t, "tick:               %u", world->tick);
 	//fill_textbox(&t, "seconds:         %f", ticks_to_seconds(world->tick));
-	fill_textbox(&t, "fps:                %f", fps);
+	fill_textbox(&t, "ticks/s:            %f", fps);
 
 	if (world->debug_extra) {
 		char buf[256] = { 0 };
@@ -976,9 +1265,8 @@ static void draw_debug_info(const world_t *world, double fps, double x, double y
 		fill_textbox(&t, "UART TX FIFO empty: %s", fifo_is_empty(uart_tx_fifo) ? "true" : "false");
 		fill_textbox(&t, "UART TX FIFO count: %u", (unsigned)fifo_count(uart_tx_fifo));
 
-		sprintf(buf, "%08lu", (unsigned long)(world->cycle_count));
+		sprintf(buf, "%08lu", (unsigned long)(snapshot->cycles));
 		fill_textbox(&t, "cycles:             %s", buf);
-		fill_textbox(&t, "cycles/tick:        %u", (unsigned)(world->cycles));
 	}
 	draw_textbox(&t);
 }
@@ -991,7 +1279,7 @@ static void fill_textbox_memory(textbox_t *t, const uint16_t * const m, const si
 		fill_textbox(t, "%s%u: %x %x %x %x", i < 10 ? " " : "", i, m[i], m[i+1], m[i+2], m[i+3]);
 }
 
-static void draw_debug_h2_screen_1(h2_t *h, double x, double y) {
+static void draw_debug_h2_screen_1(const h2_t *h, double x, double y) {
 	assert(h);
 	textbox_t t = { .x = x, .y = y, .draw_border = true, .color_text = WHITE, .color_box = WHITE };
 	fill_textbox(&t, "H2 CPU State", h->tos);
@@ -1012,11 +1300,9 @@ static void draw_debug_h2_screen_2(const h2_t * const h, const double x, const d
 	draw_textbox(&t);
 }
 
-static void draw_debug_h2_screen_3(const h2_io_t * const io, const double x, const double y) {
+static void draw_debug_h2_screen_3(const soc_registers_t * const s, const double x, const double y) {
 	textbox_t t = { .x = x, .y = y, .draw_border = true, .color_text = WHITE, .color_box = WHITE };
-	assert(io);
-	assert(io->soc);
-	const h2_soc_state_t * const s = io->soc;
+	assert(s);
 	fill_textbox(&t, "I/O");
 	fill_textbox(&t, "LED             %x", (unsigned)s->leds);
 	/*fill_textbox(&t, "VGA Cursor:     %x", (unsigned)s->vga_cursor);*/
@@ -1033,13 +1319,13 @@ static void draw_debug_h2_screen_3(const h2_io_t * const io, const double x, con
 	fill_textbox(&t, "IRQ Selector:   %x", (unsigned)s->interrupt_selector);
 	fill_textbox(&t, "");
 	fill_textbox(&t, "Flash");
-	fill_textbox(&t, "we:             %s", s->flash.we ? "on" : "off");
-	fill_textbox(&t, "cs:             %s", s->flash.cs ? "on" : "off");
-	fill_textbox(&t, "mode:           %x", (unsigned)s->flash.mode);
-	fill_textbox(&t, "status:         %x", (unsigned)s->flash.status);
-	fill_textbox(&t, "address arg 1:  %x", (unsigned)s->flash.arg1_address);
-	fill_textbox(&t, "data            %x", (unsigned)s->flash.data);
-	fill_textbox(&t, "cycle:          %x", (unsigned)s->flash.cycle);
+	fill_textbox(&t, "we:             %s", s->flash_we ? "on" : "off");
+	fill_textbox(&t, "cs:             %s", s->flash_cs ? "on" : "off");
+	fill_textbox(&t, "mode:           %x", (unsigned)s->flash_mode);
+	fill_textbox(&t, "status:         %x", (unsigned)s->flash_status);
+	fill_textbox(&t, "address arg 1:  %x", (unsigned)s->flash_arg1_address);
+	fill_textbox(&t, "data            %x", (unsigned)s->flash_data);
+	fill_textbox(&t, "cycle:          %x", (unsigned)s->flash_cycle);
 	fill_textbox(&t, "UART Control");
 	fill_textbox(&t, "UART TX Baud:   %x", (unsigned)s->uart_tx_baud);
 	fill_textbox(&t, "UART RX Baud:   %x", (unsigned)s->uart_rx_baud);
@@ -1053,7 +1339,7 @@ static void keyboard_handler(const unsigned char key, const int x, const int y)
 	assert(uart_tx_fifo);
 	assert(ps2_rx_fifo);
 	if (key == ESCAPE) {
-		world.halt_simulation = true;
+		H2_STORE_RELEASE(&world.halt_simulation, true);
 	} else {
 		if (world.use_uart_input)
 			fifo_push(uart_rx_fifo, key);
@@ -1078,10 +1364,10 @@ static void keyboard_special_handler(const int key, const int x, const int y) {
 	case GLUT_KEY_F6:    switches[2].on = !(switches[2].on); break;
 	case GLUT_KEY_F7:    switches[1].on = !(switches[1].on); break;
 	case GLUT_KEY_F8:    switches[0].on = !(switches[0].on); break;
-	case GLUT_KEY_F9:    world.step       = true;
-			     world.debug_mode = true;
+	case GLUT_KEY_F9:    H2_STORE_RELEASE(&world.step, true);
+			     H2_STORE_RELAXED(&world.debug_mode, true);
 			     break;
-	case GLUT_KEY_F10:   world.debug_mode     = !(world.debug_mode);     break;
+	case GLUT_KEY_F10:   H2_STORE_RELAXED(&world.debug_mode, !(world.debug_mode)); break;
 	case GLUT_KEY_F11:   world.use_uart_input = !(world.use_uart_input); break;
 	case GLUT_KEY_F12:   world.debug_extra    = !(world.debug_extra);    break;
 	default:
@@ -1188,71 +1474,98 @@ static void mouse_handler(const int button, const int state, const int x, const
 	}
 }
 
+static void update_switches(void) {
+	unsigned value = 0;
+	for (size_t i = 0; i < SWITCHES_COUNT; i++)
+		value |= switches[i].on << i;
+	value |= dpad.center << (SWITCHES_COUNT+0);
+	value |= dpad.right  << (SWITCHES_COUNT+1);
+	value |= dpad.left   << (SWITCHES_COUNT+2);
+	value |= dpad.down   << (SWITCHES_COUNT+3);
+	value |= dpad.up     << (SWITCHES_COUNT+4);
+	H2_STORE_RELAXED(&input_switches, value);
+}
+
+/* bring everything drawn up to date with the simulation */
+static const snapshot_t *update(void) {
+	world.tick_rate = fps();
+	update_switches();
+#ifdef __unix__
+	if (!simulation_threaded) {
+		simulation_step();
+		snapshot_publish();
+	}
+#else
+	simulation_step();
+	snapshot_publish();
+#endif
+	const snapshot_t *const s = snapshot_take();
+	for (size_t i = 0; i < LEDS_COUNT; i++)
+		leds[i].on = s->soc.leds & (1 << i);
+	for (size_t i = 0; i < SEGMENT_COUNT; i++)
+		segments[i].segment = (s->soc.led_7_segments >> ((SEGMENT_COUNT - i - 1) * 4)) & 0xf;
+
+	const fifo_data_t *span = NULL;
+	for (size_t n = 0; (n = fifo_peek(uart_tx_fifo, &span));) {
+		vt100_write(&uart_terminal.vt100, span, n);
+		fifo_discard(uart_tx_fifo, n);
+	}
+	return s;
+}
+
+/* Everything the scene depends on, if none of it changed the previous frame
+ * is still correct and redrawing it would only burn a core. */
+typedef struct {
+	uint64_t vga, uart;
+	uint16_t leds, segments, switches;
+	unsigned second;
+	bool use_uart_input, debug_extra, debug_mode;
+} scene_t;
+
+static bool scene_changed(const snapshot_t *const s) {
+	static scene_t drawn;
+	static bool initialized = false;
+	scene_t now;
+	memset(&now, 0, sizeof(now)); /* padding is compared as well */
+	now.vga            = vga_terminal.vt100.generation;
+	now.uart           = uart_terminal.vt100.generation;
+	now.leds           = s->soc.leds;
+	now.segments       = s->soc.led_7_segments;
+	now.switches       = input_switches;
+	now.second         = world.tick / seconds_to_ticks(&world, 1.0); /* blinking, statistics */
+	now.use_uart_input = world.use_uart_input;
+	now.debug_extra    = world.debug_extra;
+	now.debug_mode     = world.debug_mode;
+	if (initialized && !world.debug_extra && !memcmp(&now, &drawn, sizeof(now)))
+		return false;
+	drawn = now;
+	initialized = true;
+	return true;
+}
+
 static void timer_callback(const int value) {
 	world.tick++;
+	if (H2_LOAD_ACQUIRE(&world.halt_simulation))
+		exit(EXIT_SUCCESS);
+	if (scene_changed(update()))
+		glutPostRedisplay();
 	glutTimerFunc(world.arena_tick_ms, timer_callback, value);
 }
 
-static void update_switches(void) {
-	h2_io->soc->switches = 0;
-	for (size_t i = 0; i < SWITCHES_COUNT; i++)
-		h2_io->soc->switches |= switches[i].on << i;
-	h2_io->soc->switches |= dpad.center << (SWITCHES_COUNT+0);
-	h2_io->soc->switches |= dpad.right  << (SWITCHES_COUNT+1);
-	h2_io->soc->switches |= dpad.left   << (SWITCHES_COUNT+2);
-	h2_io->soc->switches |= dpad.down   << (SWITCHES_COUNT+3);
-	h2_io->soc->switches |= dpad.up     << (SWITCHES_COUNT+4);
-}
-
 static void draw_scene(void) {
-	static uint64_t next = 0;  // @warning static!
-	static uint64_t count = 0; // @warning static!
-	double f = fps();
-	if (world.halt_simulation)
+	const snapshot_t *const s = &snapshots[snapshot_front];
+	if (H2_LOAD_ACQUIRE(&world.halt_simulation))
 		exit(EXIT_SUCCESS);
 
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	draw_regular_polygon_line(X_MAX/2, Y_MAX/2, PI/4, sqrt(Y_MAX*Y_MAX/2)*0.99, SQUARE, LINE_WIDTH, WHITE);
 
-	update_switches();
-
-	if (next != world.tick) {
-		unsigned long increment = 0;
-		next = world.tick;
-		count++;
-		for (;!fifo_is_empty(uart_tx_fifo);) {
-			uint8_t c = 0;
-			fifo_pop(uart_tx_fifo, &c);
-			vt100_update(&uart_terminal.vt100, c);
-		}
-
-		if (world.debug_mode && world.step)
-			increment = 1;
-		else if (!(world.debug_mode))
-			increment = world.cycles;
-
-		if (!CYCLE_MODE_FIXED && increment) {
-			uint64_t n = world.cycles + (f > TARGET_FPS ? CYCLE_INCREMENT : -CYCLE_DECREMENT);
-			if (f > (TARGET_FPS + CYCLE_HYSTERESIS)) {
-				world.cycles = MIN(((uint64_t)-1), n);
-			} else if (f < (TARGET_FPS - CYCLE_HYSTERESIS)) {
-				world.cycles = MAX(CYCLE_MINIMUM, n);
-			}
-		}
-
-		if (increment)
-			if (h2_run(h, h2_io, stderr, increment, NULL, false, trace_file) < 0)
-				world.halt_simulation = true;
-
-		world.step = false;
-		world.cycle_count += increment;
-	}
-	draw_debug_info(&world, f, X_MIN + X_MAX/40., Y_MAX - Y_MAX/40.);
+	draw_debug_info(&world, s, world.tick_rate, X_MIN + X_MAX/40., Y_MAX - Y_MAX/40.);
 	if (world.debug_extra) {
-		draw_debug_h2_screen_1(h,     X_MIN + X_MAX/40., Y_MAX*0.70);
-		draw_debug_h2_screen_2(h,     X_MAX / 3.0,       Y_MAX*0.70);
-		draw_debug_h2_screen_3(h2_io, X_MAX / 1.55,  Y_MAX*0.70);
+		draw_debug_h2_screen_1(&s->cpu, X_MIN + X_MAX/40., Y_MAX*0.70);
+		draw_debug_h2_screen_2(&s->cpu, X_MAX / 3.0,       Y_MAX*0.70);
+		draw_debug_h2_screen_3(&s->soc, X_MAX / 1.55,      Y_MAX*0.70);
 	} else {
 		draw_terminal(&world, &vga_terminal, "VGA");
 	}
@@ -1284,18 +1597,16 @@ static void draw_scene(void) {
 	}
 
 	if (!world.debug_extra)
-		draw_texture(&vga_terminal,  !(count % 2));
-	draw_texture(&uart_terminal, !(count % 2));
+		draw_texture(&vga_terminal);
+	draw_texture(&uart_terminal);
 
 	glFlush();
 	glutSwapBuffers();
-	glutPostRedisplay();
 }
 
 static void initialize_rendering(char *arg_0) {
 	char *glut_argv[] = { arg_0, NULL };
 	int glut_argc = 0;
-	memset(uart_terminal.vt100.m, ' ', uart_terminal.vt100.size);
 	glutInit(&glut_argc, glut_argv);
 	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH );
 	glutInitWindowPosition(world.window_x_starting_position, world.window_y_starting_position);
@@ -1317,17 +1628,35 @@ static void vt100_initialize(vt100_t * const v) {
 	memset(&v->attribute, 0, sizeof(v->attribute));
 	v->attribute.foreground_color = WHITE;
 	v->attribute.background_color = BLACK;
-	for (size_t i = 0; i < v->size; i++)
-		v->attributes[i] = v->attribute;
+	vt100_clear(v);
 }
 
 static void finalize(void) {
+#ifdef __unix__
+	if (simulation_threaded && pthread_equal(pthread_self(), simulation_thread)) {
+		H2_STORE_RELEASE(&world.halt_simulation, true);
+		nvram_save(h2_io, FLASH_INIT_FILE); /* the simulation is this thread, so it has stopped */
+		return; /* the render thread may still be using everything else */
+	}
+	if (simulation_threaded) {
+		H2_STORE_RELEASE(&world.halt_simulation, true);
+		pthread_join(simulation_thread, NULL);
+		simulation_threaded = false;
+	}
+#endif
 	nvram_save(h2_io, FLASH_INIT_FILE);
+	h2_console_free(uart_console);
 	h2_free(h);
 	h2_io_free(h2_io);
 	fifo_free(uart_tx_fifo);
 	fifo_free(uart_rx_fifo);
 	fifo_free(ps2_rx_fifo);
+	terminal_t *terminals[] = { &vga_terminal, &uart_terminal };
+	for (size_t i = 0; i < sizeof(terminals)/sizeof(terminals[0]); i++) {
+		free(terminals[i]->vertices);
+		free(terminals[i]->coordinates);
+		free(terminals[i]->colors);
+	}
 	if (trace_file)
 		fclose(trace_file);
 }
@@ -1341,6 +1670,9 @@ int main(int argc, char **argv) {
 
 	log_level = LOG_NOTE;
 
+	if (getenv("H2_TRACE"))
+		tracepoint_enable(getenv("H2_TRACE"), true);
+
 	if (argc != 2) {
 		fprintf(stderr, "usage %s h2.hex\n", argv[0]);
 		return -1;
@@ -1355,10 +1687,19 @@ int main(int argc, char **argv) {
 		goto fail;
 	}
 	h2_io      = h2_io_new();
-	h2_io->in  = h2_io_get_gui;
-	h2_io->out = h2_io_set_gui;
+	h2_io_gui(h2_io);
+	if (getenv("H2_UART")) { /* for example "pty:/tmp/h2", see "h2 -u" */
+		const unsigned options = H2_CONSOLE_UART | H2_CONSOLE_NO_EXIT | (getenv("H2_UART_PACED") ? H2_CONSOLE_PACED : 0)
+			| (getenv("H2_PACE") ? H2_CONSOLE_NO_IDLE : 0);
+		if (!(uart_console = h2_console_open(getenv("H2_UART"))) || h2_console_attach(uart_console, h2_io, options) < 0) {
+			fprintf(stderr, "could not bridge UART to %s\n", getenv("H2_UART"));
+			goto fail;
+		}
+	}
 
 	{ /* attempt to load initial contents of VGA memory */
+		vt100_initialize(&vga_terminal.vt100);
+		vt100_initialize(&uart_terminal.vt100);
 		errno = 0;
 		FILE *vga_init = fopen(VGA_INIT_FILE, "rb");
 		static uint16_t vga_initial_contents[VGA_BUFFER_LENGTH] = { 0 };
@@ -1366,20 +1707,22 @@ int main(int argc, char **argv) {
 		if (vga_init) {
 			memory_load(vga_init, vga_initial_contents, VGA_BUFFER_LENGTH);
 			for (size_t i = 0; i < VGA_BUFFER_LENGTH; i++) {
-				vga_terminal.vt100.m[i] = vga_initial_contents[i];
-				h2_io->soc->vt100.m[i]  = vga_initial_contents[i];
+				vga_terminal.vt100.cells[i] = vga_initial_contents[i];
+				h2_io->soc->vt100.cells[i] = vga_initial_contents[i];
 			}
 			fclose(vga_init);
 		} else {
 			warning("could not load initial VGA memory file %s: %s", VGA_INIT_FILE, strerror(errno));
 		}
-		vt100_initialize(&vga_terminal.vt100);
-		vt100_initialize(&uart_terminal.vt100);
 	}
 
+	errno = 0;
+	if (atlas_load(FONT_FILE) < 0)
+		warning("could not load font %s, using stroke font: %s", FONT_FILE, errno ? strerror(errno) : "invalid format");
+
 	uart_rx_fifo = fifo_new(UART_FIFO_DEPTH);
 	uart_tx_fifo = fifo_new(UART_FIFO_DEPTH * 100); /** @note x100 to speed things up */
-	ps2_rx_fifo  = fifo_new(8 /** @bug should be 1 - but this does not work, FIFO implementation needs correcting */);
+	ps2_rx_fifo  = fifo_new(8); /* the hardware holds one key, this avoids losing fast typing */
 
 	nvram_load_and_transfer(h2_io, FLASH_INIT_FILE, true);
 
@@ -1393,6 +1736,15 @@ int main(int argc, char **argv) {
 	}
 
 	atexit(finalize);
+	if (h2_terminal_start(h2_io->soc) < 0)
+		warning("could not start terminal thread, the VT100 is updated by the simulation");
+#ifdef __unix__
+	const int e = pthread_create(&simulation_thread, NULL, simulation, NULL);
+	if (e)
+		warning("could not start simulation thread, simulating in the render loop: %s", strerror(e));
+	else
+		simulation_threaded = true;
+#endif
 	initialize_rendering(argv[0]);
 	glutMainLoop();
 
@@ -12,15 +12,22 @@
 
 /* ========================== Preamble: Types, Macros, Globals ============= */
 
+#ifdef __unix__
+#define _XOPEN_SOURCE 700 /* for clock_gettime, sockets, pseudo terminals, ... */
+#endif
+
 #include "h2.h"
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define UNUSED(VARIABLE) ((void)(VARIABLE))
 
@@ -38,8 +45,6 @@ static inline void binary(FILE *f) { UNUSED(f); }
 #define MAX(X, Y)     ((X) > (Y) ? (X) : (Y))
 #define MIN(X, Y)     ((X) > (Y) ? (Y) : (X))
 
-#define NUMBER_OF_INTERRUPTS (8u)
-
 #define OP_BRANCH        (0x0000)
 #define OP_0BRANCH       (0x2000)
 #define OP_CALL          (0x4000)
@@ -169,6 +174,16 @@ static const char *log_levels[] = {
 
 log_level_e log_level = LOG_WARNING;
 
+static const char *tracepoint_names[] = {
+#define X(ENUM, NAME) [ENUM] = NAME,
+	X_MACRO_TRACEPOINTS
+#undef X
+};
+
+#ifdef H2_TRACEPOINTS
+bool tracepoints[TRACE_MAX];
+#endif
+
 typedef struct {
 	int error;
 	int jmp_buf_valid;
@@ -198,6 +213,48 @@ int logger(log_level_e level, const char *func, const unsigned line, const char
 	return r;
 }
 
+void tracepoint_emit(const tracepoint_e tp, const char *func, const unsigned line, const char *fmt, ...) {
+	va_list ap;
+	assert(tp < TRACE_MAX);
+	assert(func);
+	assert(fmt);
+	fprintf(stderr, "[%s %u] trace %s: ", func, line, tracepoint_names[tp]);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+/* 'names' is a comma separated list of tracepoint names, or "all" */
+int tracepoint_enable(const char *names, const bool on) {
+	assert(names);
+	int r = 0;
+	while (*names) {
+		const size_t length = strcspn(names, ",");
+		bool found = false;
+		for (size_t i = 0; i < TRACE_MAX; i++) {
+			if ((length == 3 && !strncmp(names, "all", 3)) ||
+				(strlen(tracepoint_names[i]) == length && !strncmp(names, tracepoint_names[i], length))) {
+#ifdef H2_TRACEPOINTS
+				tracepoints[i] = on;
+#endif
+				found = true;
+			}
+		}
+		if (!found) {
+			error("unknown tracepoint: %.*s", (int)length, names);
+			r = -1;
+		}
+		names += length + (names[length] == ',');
+	}
+#ifndef H2_TRACEPOINTS
+	UNUSED(on);
+	warning("tracepoints not compiled in (define H2_TRACEPOINTS)");
+	r = -1;
+#endif
+	return r;
+}
+
 static const char *reason(void) {
 	static const char *unknown = "unknown reason";
 	if (errno == 0)
@@ -226,6 +283,66 @@ FILE *fopen_or_die(const char *file, const char *mode) {
 	return f;
 }
 
+double wall_clock_seconds(void) {
+#ifdef __unix__
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 0 };
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+#endif
+	return (double)clock() / (double)CLOCKS_PER_SEC;
+}
+
+static void sleep_seconds(const double seconds) {
+	if (seconds <= 0.)
+		return;
+#ifdef __unix__
+	struct timespec ts = { .tv_sec = (time_t)seconds, .tv_nsec = (long)((seconds - (double)(time_t)seconds) * 1e9) };
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+#elif defined(_WIN32)
+	Sleep((DWORD)(seconds * 1000.));
+#else
+	for (const double end = wall_clock_seconds() + seconds; wall_clock_seconds() < end;)
+		;
+#endif
+}
+
+void h2_pace_start(h2_pace_t *p, const double ratio, const uint64_t cycles) {
+	assert(p);
+	assert(ratio > 0.);
+	memset(p, 0, sizeof(*p));
+	p->ratio    = ratio;
+	p->start    = wall_clock_seconds();
+	p->reported = p->start;
+	p->cycles   = cycles;
+}
+
+/* Returns how far behind the wall clock the simulation is, in seconds. When
+ * the host cannot keep up the reference point is moved forward instead of
+ * letting the simulation run flat out later to catch up, the time lost is
+ * added to 'drift' and reported every so often. */
+double h2_pace(h2_pace_t *p, const uint64_t cycles) {
+	assert(p);
+	const double emulated = (double)(cycles - p->cycles) / (double)CLOCK_SPEED_HZ;
+	const double target = p->start + (emulated / p->ratio);
+	const double now = wall_clock_seconds();
+	if (target >= now) {
+		sleep_seconds(target - now);
+		return 0.;
+	}
+	const double behind = now - target;
+	if (behind > H2_PACE_SLACK) {
+		p->drift  += behind;
+		p->start   = now;
+		p->cycles  = cycles;
+		if ((now - p->reported) >= H2_PACE_REPORT) {
+			warning("host cannot keep up with %gx real time, %.3f seconds behind in total", p->ratio, p->drift);
+			p->reported = now;
+		}
+	}
+	return behind;
+}
+
 static int string_to_long(const int base, long *n, const char *s) {
 	char *end = NULL;
 	assert(base >= 0);
@@ -278,6 +395,7 @@ void h2_free(h2_t * const h) {
 	if (!h)
 		return;
 	free(h->bp.points);
+	free(h->profile);
 	memset(h, 0, sizeof(*h));
 	free(h);
 }
@@ -393,18 +511,28 @@ int h2_save(const h2_t * const h, FILE *output, const bool full) {
 	return memory_save(output, h->core, full ? MAX_CORE : h->pc);
 }
 
-/* From: https://stackoverflow.com/questions/215557/how-do-i-implement-a-circular-list-ring-buffer-in-c */
+/* The FIFO is shared between at most two threads, one pushing and one
+ * popping, such as the simulation and a console or renderer thread. Each
+ * side publishes its counter with a release store after touching the
+ * buffer, and acquires the other side's counter before relying on it, so
+ * no locks are needed. Counters run freely and are masked on use. */
+
+static size_t fifo_power_of_two(size_t n) {
+	size_t r = 1;
+	while (r < n)
+		r <<= 1;
+	return r;
+}
 
 fifo_t *fifo_new(const size_t size) {
-	assert(size >= 2); /* It does not make sense to have a FIFO less than this size */
-	fifo_data_t *buffer = allocate_or_die(size * sizeof(buffer[0]));
+	assert(size >= 1);
+	const size_t length = fifo_power_of_two(size);
 	fifo_t *fifo = allocate_or_die(sizeof(fifo_t));
-
-	fifo->buffer = buffer;
+	fifo->buffer = allocate_or_die(length * sizeof(fifo->buffer[0]));
 	fifo->head   = 0;
 	fifo->tail   = 0;
 	fifo->size   = size;
-
+	fifo->mask   = length - 1;
 	return fifo;
 }
 
@@ -415,57 +543,69 @@ void fifo_free(fifo_t *fifo) {
 	free(fifo);
 }
 
-bool fifo_is_full(const fifo_t * const fifo) {
+size_t fifo_count(const fifo_t * const fifo) {
 	assert(fifo);
-	return (fifo->head == (fifo->size - 1) && fifo->tail == 0)
-	    || (fifo->head == (fifo->tail - 1));
+	const size_t tail = H2_LOAD_ACQUIRE(&fifo->tail);
+	const size_t head = H2_LOAD_ACQUIRE(&fifo->head);
+	return head - tail;
+}
+
+bool fifo_is_full(const fifo_t * const fifo) {
+	return fifo_count(fifo) >= fifo->size;
 }
 
 bool fifo_is_empty(const fifo_t * const fifo) {
-	assert(fifo);
-	return fifo->head == fifo->tail;
+	return fifo_count(fifo) == 0;
 }
 
-size_t fifo_count(const fifo_t * const fifo) {
+size_t fifo_push_n(fifo_t *fifo, const fifo_data_t *data, size_t n) {
 	assert(fifo);
-	if (fifo_is_empty(fifo))
-		return 0;
-	else if (fifo_is_full(fifo))
-		return fifo->size;
-	else if (fifo->head < fifo->tail)
-		return fifo->head + (fifo->size - fifo->tail);
-	else
-		return fifo->head - fifo->tail;
+	assert(data || !n);
+	const size_t head = H2_LOAD_RELAXED(&fifo->head);
+	const size_t tail = H2_LOAD_ACQUIRE(&fifo->tail);
+	n = MIN(n, fifo->size - (head - tail));
+	for (size_t i = 0; i < n; i++)
+		fifo->buffer[(head + i) & fifo->mask] = data[i];
+	H2_STORE_RELEASE(&fifo->head, head + n);
+	return n;
 }
 
-size_t fifo_push(fifo_t * fifo, fifo_data_t data) {
+size_t fifo_pop_n(fifo_t *fifo, fifo_data_t *data, size_t n) {
 	assert(fifo);
-	if (fifo_is_full(fifo))
-		return 0;
+	assert(data || !n);
+	const size_t tail = H2_LOAD_RELAXED(&fifo->tail);
+	const size_t head = H2_LOAD_ACQUIRE(&fifo->head);
+	n = MIN(n, head - tail);
+	for (size_t i = 0; i < n; i++)
+		data[i] = fifo->buffer[(tail + i) & fifo->mask];
+	H2_STORE_RELEASE(&fifo->tail, tail + n);
+	return n;
+}
 
-	fifo->buffer[fifo->head] = data;
+size_t fifo_peek(const fifo_t *fifo, const fifo_data_t **span) {
+	assert(fifo);
+	assert(span);
+	const size_t tail  = H2_LOAD_RELAXED(&fifo->tail);
+	const size_t head  = H2_LOAD_ACQUIRE(&fifo->head);
+	const size_t index = tail & fifo->mask;
+	*span = &fifo->buffer[index];
+	return MIN(head - tail, (fifo->mask + 1) - index);
+}
 
-	fifo->head++;
-	if (fifo->head == fifo->size)
-		fifo->head = 0;
+void fifo_discard(fifo_t *fifo, const size_t n) {
+	assert(fifo);
+	const size_t tail = H2_LOAD_RELAXED(&fifo->tail);
+	assert(n <= H2_LOAD_ACQUIRE(&fifo->head) - tail);
+	H2_STORE_RELEASE(&fifo->tail, tail + n);
+}
 
-	return 1;
+size_t fifo_push(fifo_t * fifo, fifo_data_t data) {
+	return fifo_push_n(fifo, &data, 1);
 }
 
 size_t fifo_pop(fifo_t * fifo, fifo_data_t * data) {
-	assert(fifo);
 	assert(data);
-
-	if (fifo_is_empty(fifo))
-		return 0;
-
-	*data = fifo->buffer[fifo->tail];
-
-	fifo->tail++;
-	if (fifo->tail == fifo->size)
-		fifo->tail = 0;
-
-	return 1;
+	return fifo_pop_n(fifo, data, 1);
 }
 
 #ifdef __unix__
@@ -555,7 +695,7 @@ static symbol_table_t *symbol_table_new(void) {
 	return t;
 }
 
-static void symbol_table_free(symbol_table_t *t) {
+void symbol_table_free(symbol_table_t *t) {
 	if (!t)
 		return;
 	for (size_t i = 0; i < t->length; i++)
@@ -979,178 +1119,300 @@ static void terminal_parse_attribute(vt100_attribute_t * const a, const unsigned
 	}
 }
 
-static const vt100_attribute_t vt100_default_attribute = {
-	.foreground_color = WHITE,
-	.background_color = BLACK,
-};
+uint16_t vt100_cell_pack(const vt100_attribute_t attribute, uint8_t c) {
+	unsigned foreground = attribute.foreground_color, background = attribute.background_color;
+	if (attribute.reverse_video) { /* the hardware has no reverse video bit */
+		const unsigned t = foreground;
+		foreground = background;
+		background = t;
+	}
+	if (attribute.conceal)
+		c = '*';
+	return c | (background << 8) | (foreground << 11)
+		| (attribute.bold  ? VT100_CELL_BOLD  : 0)
+		| (attribute.blink ? VT100_CELL_BLINK : 0);
+}
+
+vt100_attribute_t vt100_cell_attribute(const uint16_t cell) {
+	const vt100_attribute_t a = {
+		.bold             = !!(cell & VT100_CELL_BOLD),
+		.blink            = !!(cell & VT100_CELL_BLINK),
+		.foreground_color = VT100_CELL_FOREGROUND(cell),
+		.background_color = VT100_CELL_BACKGROUND(cell),
+	};
+	return a;
+}
+
+/* Logical positions (what the cursor and the display see) map onto physical
+ * rows through 't->top', so scrolling never has to move the screen. */
+static inline size_t terminal_physical(const vt100_t * const t, const size_t index) {
+	assert(t->width && t->height);
+	const size_t row = ((index / t->width) + t->top) % t->height;
+	return (row * t->width) + (index % t->width);
+}
 
-static void terminal_attribute_block_set(vt100_t *t, const size_t size, const vt100_attribute_t * const a) {
+const uint16_t *vt100_row(const vt100_t *t, const unsigned y) {
 	assert(t);
-	assert(a);
-	for (size_t i = 0; i < size; i++)
-		memcpy(&t->attributes[i], a, sizeof(*a));
+	assert(y < t->height);
+	return &t->cells[terminal_physical(t, (size_t)y * t->width)];
 }
 
-static int terminal_escape_sequences(vt100_t * const t, const uint8_t c) {
+uint16_t vt100_cell(const vt100_t *t, const size_t index) {
+	assert(t);
+	assert(index < t->size);
+	return t->cells[terminal_physical(t, index)];
+}
+
+uint8_t vt100_char(const vt100_t *t, const size_t index) {
+	return VT100_CELL_CHARACTER(vt100_cell(t, index));
+}
+
+vt100_attribute_t vt100_attribute(const vt100_t *t, const size_t index) {
+	return vt100_cell_attribute(vt100_cell(t, index));
+}
+
+/* mark logical rows 'first' to 'last' inclusive as needing a redraw */
+void vt100_damage(vt100_t *t, const unsigned first, const unsigned last) {
+	assert(t);
+	assert(last < VT100_MAX_ROWS);
+	for (unsigned y = first; y <= last; y++)
+		t->dirty[y / 32] |= UINT32_C(1) << (y % 32);
+}
+
+bool vt100_row_dirty(const vt100_t *t, const unsigned y) {
+	assert(t);
+	assert(y < VT100_MAX_ROWS);
+	return !!(t->dirty[y / 32] & (UINT32_C(1) << (y % 32)));
+}
+
+void vt100_clean(vt100_t *t) {
+	assert(t);
+	memset(t->dirty, 0, sizeof(t->dirty));
+}
+
+static void terminal_fill(vt100_t *t, const size_t start, const size_t end, const uint16_t cell) {
+	assert(t);
+	assert(end <= t->size);
+	if (start >= end)
+		return;
+	for (size_t i = start; i < end; i++)
+		t->cells[terminal_physical(t, i)] = cell;
+	vt100_damage(t, start / t->width, (end - 1) / t->width);
+}
+
+void vt100_clear(vt100_t *t) {
+	assert(t);
+	t->top = 0;
+	terminal_fill(t, 0, t->size, VT100_CELL_BLANK);
+}
+
+static void terminal_attribute_set(vt100_t *t) {
+	assert(t);
+	uint16_t * const cell = &t->cells[terminal_physical(t, t->cursor)];
+	*cell = VT100_CELL_CHARACTER(*cell) | (vt100_cell_pack(t->attribute, 0) & 0xFF00u);
+	vt100_damage(t, t->cursor / t->width, t->cursor / t->width);
+}
+
+/* The escape sequence parser is driven by a table indexed by the current
+ * state and the class of the incoming character, only a final character
+ * ends up in 'terminal_command', which executes the sequence. */
+typedef enum {
+	TERMINAL_CLASS_DIGIT,
+	TERMINAL_CLASS_SEMICOLON,
+	TERMINAL_CLASS_QUESTION,
+	TERMINAL_CLASS_BRACKET,
+	TERMINAL_CLASS_FINAL,
+	TERMINAL_CLASS_END,
+} terminal_class_t;
+
+typedef enum {
+	TERMINAL_ACTION_FAIL,     /* invalid sequence, return to normal mode */
+	TERMINAL_ACTION_NEXT,     /* change state only */
+	TERMINAL_ACTION_DEFAULT,  /* reset the arguments */
+	TERMINAL_ACTION_START,    /* reset the arguments, first digit of n1 */
+	TERMINAL_ACTION_DIGIT_1,  /* accumulate a digit into n1 */
+	TERMINAL_ACTION_DIGIT_2,  /* accumulate a digit into n2 */
+	TERMINAL_ACTION_SECOND,   /* n1 done, move on to n2 */
+	TERMINAL_ACTION_COMMAND,  /* final character, execute the sequence */
+} terminal_action_t;
+
+typedef struct {
+	uint8_t next;   /**< terminal_state_t */
+	uint8_t action; /**< terminal_action_t */
+	uint8_t limit;  /**< maximum digits already accumulated for a DIGIT action */
+} terminal_transition_t;
+
+#define T(NEXT, ACTION, LIMIT) { TERMINAL_ ## NEXT, TERMINAL_ACTION_ ## ACTION, LIMIT }
+#define F T(NORMAL_MODE, FAIL,    0)
+#define C T(NORMAL_MODE, COMMAND, 0)
+static const terminal_transition_t terminal_transitions[TERMINAL_STATE_END][TERMINAL_CLASS_END] = {
+	/*                       DIGIT                     ';'                       '?'                     '['                FINAL */
+	[TERMINAL_CSI]      = { C,                        F,                        F,                      T(COMMAND, NEXT, 0), C }, /* ESC 7, ESC 8 */
+	[TERMINAL_COMMAND]  = { T(NUMBER_1, START,   0), T(NUMBER_2, DEFAULT, 0), T(DECTCEM, DEFAULT, 0), F,                   C },
+	[TERMINAL_NUMBER_1] = { T(NUMBER_1, DIGIT_1, 3), T(NUMBER_2, SECOND,  0), F,                      F,                   C },
+	[TERMINAL_NUMBER_2] = { T(NUMBER_2, DIGIT_2, 3), F,                        F,                      F,                   C },
+	[TERMINAL_DECTCEM]  = { T(DECTCEM,  DIGIT_1, 1), F,                        F,                      F,                   C },
+};
+#undef T
+#undef F
+#undef C
+
+static terminal_class_t terminal_class(const uint8_t c) {
+	switch (c) {
+	case ';': return TERMINAL_CLASS_SEMICOLON;
+	case '?': return TERMINAL_CLASS_QUESTION;
+	case '[': return TERMINAL_CLASS_BRACKET;
+	}
+	return isdigit(c) ? TERMINAL_CLASS_DIGIT : TERMINAL_CLASS_FINAL;
+}
+
+static unsigned terminal_digit(const vt100_t * const t, const unsigned n, const uint8_t c) {
+	return (n * (t->command_index ? 10 : 0)) + (c - '0');
+}
+
+/* execute a sequence ending in 'c', the state is the one before 'c' */
+static int terminal_command(vt100_t * const t, const uint8_t c) {
 	assert(t);
-	assert(t->state != TERMINAL_NORMAL_MODE);
 	switch (t->state) {
-	case TERMINAL_CSI: /* process CSI and some non-CSI Escape Only commands */
+	case TERMINAL_CSI: /* some non-CSI Escape Only commands */
 		switch (c) {
-		case '[': t->state = TERMINAL_COMMAND; break;
-		case 'c': goto eraser; /*reset display*/ break;
-		case '7': t->cursor_saved = t->cursor; t->attribute_saved = t->attribute; break;
-		case '8': t->cursor = t->cursor_saved; t->attribute = t->attribute_saved; break;
-		default: goto fail;
+		case 'c': t->cursor = 0; vt100_clear(t); /*reset display*/ return 0;
+		case '7': t->cursor_saved = t->cursor; t->attribute_saved = t->attribute; return 0;
+		case '8': t->cursor = t->cursor_saved; t->attribute = t->attribute_saved; return 0;
 		}
-
-		break;
+		return -1;
 	case TERMINAL_COMMAND:
 		switch (c) {
-		case 's':
-			t->cursor_saved = t->cursor;
-			goto success;
-		case 'n':
-			t->cursor = t->cursor_saved;
-			goto success;
-		case '?':
-			terminal_default_command_sequence(t);
-			t->state = TERMINAL_DECTCEM;
-			break;
-		case ';':
-			terminal_default_command_sequence(t);
-			t->state = TERMINAL_NUMBER_2;
-			break;
-		default:
-			if (isdigit(c)) {
-				terminal_default_command_sequence(t);
-				t->command_index++;
-				t->n1 = c - '0';
-				t->state = TERMINAL_NUMBER_1;
-			} else {
-				goto fail;
-			}
+		case 's': t->cursor_saved = t->cursor; return 0;
+		case 'n': t->cursor = t->cursor_saved; return 0;
 		}
-		break;
+		return -1;
 	case TERMINAL_NUMBER_1:
-		if (isdigit(c)) {
-			if (t->command_index > 3)
-				goto fail;
-			t->n1 = (t->n1 * (t->command_index ? 10 : 0)) + (c - '0');
-			t->command_index++;
-			break;
-		}
-
 		switch (c) {
-		case 'A': terminal_at_xy_relative(t,  0,     -t->n1, true); goto success;/* relative cursor up */
-		case 'B': terminal_at_xy_relative(t,  0,      t->n1, true); goto success;/* relative cursor down */
-		case 'C': terminal_at_xy_relative(t,  t->n1,  0,     true); goto success;/* relative cursor forward */
-		case 'D': terminal_at_xy_relative(t, -t->n1,  0,     true); goto success;/* relative cursor back */
-		case 'E': terminal_at_xy(t, 0,  t->n1, false); goto success; /* relative cursor down, beginning of line */
-		case 'F': terminal_at_xy(t, 0, -t->n1, false); goto success; /* relative cursor up, beginning of line */
-		case 'G': terminal_at_xy(t, t->n1, terminal_y_current(t), true); goto success; /* move the cursor to column n */
+		case 'A': terminal_at_xy_relative(t,  0,     -t->n1, true); return 0; /* relative cursor up */
+		case 'B': terminal_at_xy_relative(t,  0,      t->n1, true); return 0; /* relative cursor down */
+		case 'C': terminal_at_xy_relative(t,  t->n1,  0,     true); return 0; /* relative cursor forward */
+		case 'D': terminal_at_xy_relative(t, -t->n1,  0,     true); return 0; /* relative cursor back */
+		case 'E': terminal_at_xy(t, 0,  t->n1, false); return 0; /* relative cursor down, beginning of line */
+		case 'F': terminal_at_xy(t, 0, -t->n1, false); return 0; /* relative cursor up, beginning of line */
+		case 'G': terminal_at_xy(t, t->n1, terminal_y_current(t), true); return 0; /* move the cursor to column n */
 		case 'm': /* set attribute, CSI number m */
 			terminal_parse_attribute(&t->attribute, t->n1);
-			t->attributes[t->cursor] = t->attribute;
-			goto success;
+			terminal_attribute_set(t);
+			return 0;
 		case 'i': /* AUX Port On == 5, AUX Port Off == 4 */
-			if (t->n1 == 5 || t->n1 == 4)
-				goto success;
-			goto fail;
+			return t->n1 == 5 || t->n1 == 4 ? 0 : -1;
 		case 'n': /* Device Status Report */
 			/** @note This should transmit to the H2 system the
 			 * following "ESC[n;mR", where n is the row and m is the column,
 			 * we're not going to do this as the hardware does not, although
 			 * 'fifo_push()' on 'uart_rx_fifo' could be called to do this */
-			if (t->n1 == 6)
-				goto success;
-			goto fail;
-eraser: /* HAHA: This is clearly the best way of doing things. */
-			t->command_index = 1;
-			t->n1 = 3; /* fall-through */
+			return t->n1 == 6 ? 0 : -1;
 		case 'J': /* reset */
-
 			switch (t->n1) {
 			case 3: /* fall-through */
 			case 2: t->cursor = 0; /* with cursor */ /* fall-through */
-			case 1:
-				if (t->command_index) {
-					memset(t->m, ' ', t->size);
-					terminal_attribute_block_set(t, t->size, &vt100_default_attribute);
-					goto success;
-				} /* fall through if number not supplied */ /* fall-through */
-			case 0:
-				memset(t->m, ' ', t->cursor);
-				terminal_attribute_block_set(t, t->cursor, &vt100_default_attribute);
-				goto success;
+			case 1: vt100_clear(t); return 0;
+			case 0: terminal_fill(t, 0, t->cursor, VT100_CELL_BLANK); return 0;
 			}
-			goto fail;
-		case ';':
-			t->command_index = 0;
-			t->state = TERMINAL_NUMBER_2;
-			break;
-		default:
-			goto fail;
+			return -1;
 		}
-		break;
+		return -1;
 	case TERMINAL_NUMBER_2:
-		if (isdigit(c)) {
-			if (t->command_index > 3)
-				goto fail;
-			t->n2 = (t->n2 * (t->command_index ? 10 : 0)) + (c - '0');
-			t->command_index++;
-		} else {
-			switch (c) {
-			case 'm':
-				terminal_parse_attribute(&t->attribute, t->n1);
-				terminal_parse_attribute(&t->attribute, t->n2);
-				t->attributes[t->cursor] = t->attribute;
-				goto success;
-			case 'H':
-			case 'f':
-				terminal_at_xy(t, MIN(t->n2-1,t->n2), MIN(t->n1-1,t->n1), true);
-				goto success;
-			}
-			goto fail;
+		switch (c) {
+		case 'm':
+			terminal_parse_attribute(&t->attribute, t->n1);
+			terminal_parse_attribute(&t->attribute, t->n2);
+			terminal_attribute_set(t);
+			return 0;
+		case 'H':
+		case 'f':
+			terminal_at_xy(t, MIN(t->n2-1,t->n2), MIN(t->n1-1,t->n1), true);
+			return 0;
 		}
-		break;
+		return -1;
 	case TERMINAL_DECTCEM:
-		if (isdigit(c)) {
-			if (t->command_index > 1)
-				goto fail;
-			t->n1 = (t->n1 * (t->command_index ? 10 : 0)) + (c - '0');
-			t->command_index++;
-			break;
-		}
-
 		if (t->n1 != 25)
-			goto fail;
+			return -1;
 		switch (c) {
-		case 'l': t->cursor_on = false; goto success;
-		case 'h': t->cursor_on = true;  goto success;
-		default:
-			goto fail;
+		case 'l': t->cursor_on = false; return 0;
+		case 'h': t->cursor_on = true;  return 0;
 		}
-	case TERMINAL_STATE_END:
-		t->state = TERMINAL_NORMAL_MODE;
-		break;
+		return -1;
 	default:
 		fatal("invalid terminal state: %u", (unsigned)t->state);
 	}
-
-	return 0;
-success:
-	t->state = TERMINAL_NORMAL_MODE;
-	return 0;
-fail:
-	t->state = TERMINAL_NORMAL_MODE;
 	return -1;
 }
 
+static int terminal_escape_sequences(vt100_t * const t, const uint8_t c) {
+	assert(t);
+	assert(t->state != TERMINAL_NORMAL_MODE && t->state < TERMINAL_STATE_END);
+	const terminal_transition_t *x = &terminal_transitions[t->state][terminal_class(c)];
+	int r = 0;
+	switch (x->action) {
+	case TERMINAL_ACTION_FAIL:
+		r = -1;
+		break;
+	case TERMINAL_ACTION_NEXT:
+		break;
+	case TERMINAL_ACTION_START:
+		terminal_default_command_sequence(t); /* fall-through */
+	case TERMINAL_ACTION_DIGIT_1:
+		if (t->command_index > x->limit) {
+			r = -1;
+			break;
+		}
+		t->n1 = terminal_digit(t, t->n1, c);
+		t->command_index++;
+		break;
+	case TERMINAL_ACTION_DIGIT_2:
+		if (t->command_index > x->limit) {
+			r = -1;
+			break;
+		}
+		t->n2 = terminal_digit(t, t->n2, c);
+		t->command_index++;
+		break;
+	case TERMINAL_ACTION_DEFAULT:
+		terminal_default_command_sequence(t);
+		break;
+	case TERMINAL_ACTION_SECOND:
+		t->command_index = 0;
+		break;
+	case TERMINAL_ACTION_COMMAND:
+		r = terminal_command(t, c);
+		break;
+	default:
+		fatal("invalid terminal action: %u", (unsigned)x->action);
+	}
+	t->state = r < 0 ? TERMINAL_NORMAL_MODE : (terminal_state_t)x->next;
+	return r;
+}
+
+/* characters that need more than storing in the current cell */
+static inline bool terminal_special(const uint8_t c) {
+	return c == ESCAPE || c == '\t' || c == '\n' || c == '\r' || c == BACKSPACE;
+}
+
+static void terminal_scroll(vt100_t * const t) {
+	assert(t);
+	if (t->cursor >= t->size) { /* scroll: rotate the ring, blank the new bottom row */
+		t->cursor -= t->width;
+		t->top = (t->top + 1) % t->height;
+		terminal_fill(t, t->size - t->width, t->size, VT100_CELL_BLANK);
+		vt100_damage(t, 0, t->height - 1); /* every row moved on the display */
+	}
+	t->cursor %= t->size;
+}
+
 void vt100_update(vt100_t *t, const uint8_t c) {
 	assert(t);
 	assert(t->size <= VT100_MAX_SIZE);
 	assert((t->width * t->height) <= VT100_MAX_SIZE);
+	assert(t->height <= VT100_MAX_ROWS);
+	tracepoint(TRACE_VT100, "char %02x cursor %u state %u", (unsigned)c, (unsigned)t->cursor, (unsigned)t->state);
+	t->generation++; /* even escape sequences move the cursor */
 
 	if (t->state != TERMINAL_NORMAL_MODE) {
 		if (terminal_escape_sequences(t, c)) {
@@ -1177,22 +1439,53 @@ void vt100_update(vt100_t *t, const uint8_t c) {
 			break;
 		default:
 			assert(t->cursor < t->size);
-			t->m[t->cursor] = c;
-			memcpy(&t->attributes[t->cursor], &t->attribute, sizeof(t->attribute));
+			t->cells[terminal_physical(t, t->cursor)] = vt100_cell_pack(t->attribute, c);
+			vt100_damage(t, t->cursor / t->width, t->cursor / t->width);
 			t->cursor++;
 		}
-		if (t->cursor >= t->size) {
-			const vt100_attribute_t *a = &vt100_default_attribute;
-			t->cursor -= t->width;
-			memmove(t->m, t->m + t->width, t->size - t->width);
-			memset((t->m + t->size) - t->width, ' ', t->width);
-			for (size_t i = 0; i < (t->size - t->width); i++)
-				t->attributes[i] = t->attributes[i + t->width];
-			for (size_t i = t->size - t->width; i < t->size; i++)
-				memcpy(&t->attributes[i], a, sizeof(*a));
+		terminal_scroll(t);
+	}
+}
+
+/* Runs of ordinary characters are copied a row segment at a time, the
+ * attribute is packed once per run and the loop is simple enough for the
+ * compiler to vectorise; everything else goes through 'vt100_update'. */
+size_t vt100_write(vt100_t *t, const uint8_t *buf, const size_t length) {
+	assert(t);
+	assert(buf);
+	assert(t->size <= VT100_MAX_SIZE);
+	assert(t->height <= VT100_MAX_ROWS);
+	t->generation++;
+	for (size_t i = 0; i < length;) {
+		if (t->state != TERMINAL_NORMAL_MODE || terminal_special(buf[i])) {
+			vt100_update(t, buf[i++]);
+			continue;
+		}
+		size_t run = i + 1;
+		while (run < length && !terminal_special(buf[run]))
+			run++;
+		const uint16_t style = vt100_cell_pack(t->attribute, 0) & 0xFF00u;
+		const bool conceal = t->attribute.conceal;
+		while (i < run) {
+			assert(t->cursor < t->size);
+			const size_t column = t->cursor % t->width;
+			const size_t n = MIN(run - i, t->width - column);
+			uint16_t * const cells = &t->cells[terminal_physical(t, t->cursor)];
+			tracepoint(TRACE_VT100, "run %u cursor %u", (unsigned)n, (unsigned)t->cursor);
+			if (conceal) {
+				for (size_t j = 0; j < n; j++)
+					cells[j] = style | '*';
+			} else {
+				for (size_t j = 0; j < n; j++)
+					cells[j] = style | buf[i + j];
+			}
+			vt100_damage(t, t->cursor / t->width, t->cursor / t->width);
+			t->cursor += n;
+			i += n;
+			terminal_scroll(t);
 		}
-		t->cursor %= t->size;
 	}
+	return length;
 }
 
 #define FLASH_WRITE_CYCLES (20)  /* x10ns */
@@ -1381,6 +1674,7 @@ static bool address_protected(const flash_t *const f, const uint32_t addr) {
  * purposes. */
 static void h2_io_flash_update(flash_t * const f, const uint32_t addr, const uint16_t data, const bool oe, const bool we, const bool rst, const bool cs) {
 	assert(f);
+	const unsigned mode = f->mode;
 	if (oe && we)
 		warning("OE and WE set at the same time");
 
@@ -1439,6 +1733,7 @@ static void h2_io_flash_update(flash_t * const f, const uint32_t addr, const uin
 	case FLASH_WORD_PROGRAMMING:
 		if (f->cycle++ > FLASH_WRITE_CYCLES) {
 			f->nvram[f->arg1_address] &= f->data;
+			f->programs++;
 			f->mode         = FLASH_READ_STATUS_REGISTER;
 			f->cycle        = 0;
 			f->status |= FLASH_STATUS_DEVICE_READY;
@@ -1510,6 +1805,7 @@ static void h2_io_flash_update(flash_t * const f, const uint32_t addr, const uin
 				f->status |= FLASH_STATUS_ERASE_BLANK;
 			} else {
 				memset(f->nvram+block*size, 0xff, sizeof(f->nvram[0])*size);
+				f->erases++;
 			}
 			f->cycle = 0;
 			f->mode = FLASH_READ_STATUS_REGISTER;
@@ -1530,6 +1826,8 @@ static void h2_io_flash_update(flash_t * const f, const uint32_t addr, const uin
 		f->data = data;
 	f->we = we;
 	f->cs = cs;
+	if (mode != f->mode)
+		tracepoint(TRACE_FLASH, "mode %u -> %u addr %"PRIx32" data %"PRIx16" status %"PRIx8, mode, f->mode, f->arg1_address, f->data, f->status);
 }
 
 uint16_t h2_io_memory_read_operation(const h2_soc_state_t * const soc) {
@@ -1555,83 +1853,126 @@ uint16_t h2_io_memory_read_operation(const h2_soc_state_t * const soc) {
 	return 0;
 }
 
-static uint16_t h2_io_get_default(h2_soc_state_t * const soc, const uint16_t addr, bool *debug_on) {
-	assert(soc);
-	debug("IO read addr: %"PRIx16, addr);
-	(void)debug_on;
-	switch (addr) {
-	case iUart:         return UART_TX_FIFO_EMPTY | soc->uart_getchar_register;
-	case iVT100:        return UART_TX_FIFO_EMPTY | soc->ps2_getchar_register;
-	case iSwitches:     return soc->switches;
-	case iTimerDin:     return soc->timer;
-	case iMemDin:       return h2_io_memory_read_operation(soc);
-	default:
-		warning("invalid read from %04"PRIx16, addr);
-	}
+static uint16_t h2_io_get_invalid(h2_soc_state_t * const soc, const uint16_t addr, bool *debug_on, void *param) {
+	UNUSED(soc);
+	UNUSED(debug_on);
+	UNUSED(param);
+	warning("invalid read from %04"PRIx16, addr);
 	return 0;
 }
 
-static void h2_io_set_default(h2_soc_state_t *soc, const uint16_t addr, const uint16_t value, bool *debug_on) {
+static void h2_io_set_invalid(h2_soc_state_t * const soc, const uint16_t addr, const uint16_t value, bool *debug_on, void *param) {
+	UNUSED(soc);
+	UNUSED(debug_on);
+	UNUSED(param);
+	warning("invalid write to %04"PRIx16 ":%04"PRIx16, addr, value);
+}
+
+/* 'param' points to a 16-bit register within the SoC state */
+static uint16_t h2_io_get_register(h2_soc_state_t * const soc, const uint16_t addr, bool *debug_on, void *param) {
+	assert(param);
+	UNUSED(soc);
+	UNUSED(addr);
+	UNUSED(debug_on);
+	return *(uint16_t*)param;
+}
+
+static void h2_io_set_register(h2_soc_state_t * const soc, const uint16_t addr, const uint16_t value, bool *debug_on, void *param) {
+	assert(param);
+	UNUSED(soc);
+	UNUSED(addr);
+	UNUSED(debug_on);
+	*(uint16_t*)param = value;
+}
+
+static uint16_t h2_io_get_uart(h2_soc_state_t * const soc, const uint16_t addr, bool *debug_on, void *param) {
 	assert(soc);
-	debug("IO write addr/value: %"PRIx16"/%"PRIx16, addr, value);
-
-	switch (addr) {
-	case oUart:
-			if (value & UART_TX_WE)
-				putch(0xFF & value);
-			if (value & UART_RX_RE)
-				soc->uart_getchar_register = wrap_getch(debug_on);
-			break;
-	case oLeds:       soc->leds           = value; break;
-	case oTimerCtrl:  soc->timer_control  = value; break;
-	case oVT100:
-		if (value & UART_TX_WE)
-			vt100_update(&soc->vt100, value);
-		if (value & UART_RX_RE)
-			soc->ps2_getchar_register = wrap_getch(debug_on);
-		break;
-	case o7SegLED:    soc->led_7_segments = value; break;
-	case oIrcMask:    soc->irc_mask       = value; break;
-	case oMemControl:
-	{
-		soc->mem_control   = value;
-		const bool sram_cs = soc->mem_control & SRAM_CHIP_SELECT;
-		const bool oe      = soc->mem_control & FLASH_MEMORY_OE;
-		const bool we      = soc->mem_control & FLASH_MEMORY_WE;
-
-		if (sram_cs && !oe && we)
-			soc->vram[(((uint32_t)(soc->mem_control & FLASH_MASK_ADDR_UPPER_MASK) << 16) | soc->mem_addr_low) >> 1] = soc->mem_dout;
-		break;
-	}
-	case oMemAddrLow:  soc->mem_addr_low = value; break;
-	case oMemDout:     soc->mem_dout     = value; break;
-	case oUartTxBaud:  soc->uart_tx_baud = value; break;
-	case oUartRxBaud:  soc->uart_rx_baud = value; break;
-	case oUartControl: soc->uart_control = value; break;
-	default:
-		warning("invalid write to %04"PRIx16 ":%04"PRIx16, addr, value);
-	}
+	UNUSED(addr);
+	UNUSED(debug_on);
+	UNUSED(param);
+	return UART_TX_FIFO_EMPTY | soc->uart_getchar_register;
+}
+
+static uint16_t h2_io_get_vt100(h2_soc_state_t * const soc, const uint16_t addr, bool *debug_on, void *param) {
+	assert(soc);
+	UNUSED(addr);
+	UNUSED(debug_on);
+	UNUSED(param);
+	return UART_TX_FIFO_EMPTY | soc->ps2_getchar_register;
+}
+
+static uint16_t h2_io_get_memory(h2_soc_state_t * const soc, const uint16_t addr, bool *debug_on, void *param) {
+	UNUSED(addr);
+	UNUSED(debug_on);
+	UNUSED(param);
+	return h2_io_memory_read_operation(soc);
 }
 
-static void h2_io_update_default(h2_soc_state_t * const soc) {
+static void h2_io_set_uart(h2_soc_state_t * const soc, const uint16_t addr, const uint16_t value, bool *debug_on, void *param) {
 	assert(soc);
+	UNUSED(addr);
+	UNUSED(param);
+	if (value & UART_TX_WE)
+		putch(0xFF & value);
+	if (value & UART_RX_RE)
+		soc->uart_getchar_register = wrap_getch(debug_on);
+}
 
-	if (soc->timer_control & TIMER_ENABLE) {
-		if (soc->timer_control & TIMER_RESET) {
-			soc->timer = 0;
-			soc->timer_control &= ~TIMER_RESET;
-		} else {
-			soc->timer++;
-			if ((soc->timer > (soc->timer_control & 0x1FFF))) {
-				if (soc->timer_control & TIMER_INTERRUPT_ENABLE) {
-					soc->interrupt           = soc->irc_mask & (1 << isrTimer);
-					soc->interrupt_selector |= soc->irc_mask & (1 << isrTimer);
-				}
-				soc->timer = 0;
-			}
+static void h2_io_set_vt100(h2_soc_state_t * const soc, const uint16_t addr, const uint16_t value, bool *debug_on, void *param) {
+	assert(soc);
+	UNUSED(addr);
+	UNUSED(param);
+	if (value & UART_TX_WE)
+		h2_terminal_put(soc, value);
+	if (value & UART_RX_RE)
+		soc->ps2_getchar_register = wrap_getch(debug_on);
+}
+
+static void h2_io_set_leds(h2_soc_state_t * const soc, const uint16_t addr, const uint16_t value, bool *debug_on, void *param) {
+	assert(soc);
+	UNUSED(addr);
+	UNUSED(debug_on);
+	UNUSED(param);
+	soc->leds = value;
+}
+
+static void h2_io_set_memory_control(h2_soc_state_t * const soc, const uint16_t addr, const uint16_t value, bool *debug_on, void *param) {
+	assert(soc);
+	UNUSED(addr);
+	UNUSED(debug_on);
+	UNUSED(param);
+	soc->mem_control   = value;
+	const bool sram_cs = soc->mem_control & SRAM_CHIP_SELECT;
+	const bool oe      = soc->mem_control & FLASH_MEMORY_OE;
+	const bool we      = soc->mem_control & FLASH_MEMORY_WE;
+
+	if (sram_cs && !oe && we)
+		soc->vram[(((uint32_t)(soc->mem_control & FLASH_MASK_ADDR_UPPER_MASK) << 16) | soc->mem_addr_low) >> 1] = soc->mem_dout;
+}
+
+static void h2_timer_update(h2_soc_state_t * const soc, void *param) {
+	assert(soc);
+	UNUSED(param);
+	if (!(soc->timer_control & TIMER_ENABLE))
+		return;
+	if (soc->timer_control & TIMER_RESET) {
+		soc->timer = 0;
+		soc->timer_control &= ~TIMER_RESET;
+		return;
+	}
+	soc->timer++;
+	if ((soc->timer > (soc->timer_control & 0x1FFF))) {
+		if (soc->timer_control & TIMER_INTERRUPT_ENABLE) {
+			soc->interrupt           = soc->irc_mask & (1 << isrTimer);
+			soc->interrupt_selector |= soc->irc_mask & (1 << isrTimer);
 		}
+		soc->timer = 0;
 	}
+}
 
+static void h2_dpad_update(h2_soc_state_t * const soc, void *param) {
+	assert(soc);
+	UNUSED(param);
 	/* DPAD interrupt on change state */
 	const uint16_t prev = soc->switches_previous;
 	const uint16_t cur  = soc->switches;
@@ -1640,7 +1981,11 @@ static void h2_io_update_default(h2_soc_state_t * const soc) {
 		soc->interrupt_selector |= soc->irc_mask & (1u << isrDPadButton);
 	}
 	soc->switches_previous = soc->switches;
+}
 
+static void h2_flash_update(h2_soc_state_t * const soc, void *param) {
+	assert(soc);
+	UNUSED(param);
 	const uint32_t flash_addr = ((uint32_t)(soc->mem_control & FLASH_MASK_ADDR_UPPER_MASK) << 16) | soc->mem_addr_low;
 	const bool flash_rst = soc->mem_control & FLASH_MEMORY_RESET;
 	const bool flash_cs  = soc->mem_control & FLASH_CHIP_SELECT;
@@ -1649,6 +1994,17 @@ static void h2_io_update_default(h2_soc_state_t * const soc) {
 	h2_io_flash_update(&soc->flash, flash_addr >> 1, soc->mem_dout, oe, we, flash_rst, flash_cs);
 }
 
+static void h2_io_update_peripherals(h2_io_t * const io) {
+	assert(io);
+	for (size_t i = 0; i < io->peripheral_count; i++) {
+		h2_peripheral_t * const p = &io->peripherals[i];
+		if (!p->update || --p->countdown)
+			continue;
+		p->countdown = p->period;
+		p->update(io->soc, p->param);
+	}
+}
+
 h2_soc_state_t *h2_soc_state_new(void) {
 	h2_soc_state_t *r = allocate_or_die(sizeof(h2_soc_state_t));
 	vt100_t *v = &r->vt100;
@@ -1665,30 +2021,152 @@ h2_soc_state_t *h2_soc_state_new(void) {
 	v->n2           = 1;
 	v->attribute.foreground_color = WHITE;
 	v->attribute.background_color = BLACK;
-	for (size_t i = 0; i < v->size; i++)
-		v->attributes[i] = v->attribute;
+	vt100_clear(v);
 	return r;
 }
 
 void h2_soc_state_free(h2_soc_state_t *soc) {
 	if (!soc)
 		return;
+	h2_terminal_stop(soc);
 	memset(soc, 0, sizeof(*soc));
 	free(soc);
 }
 
-h2_io_t *h2_io_new(void) {
-	h2_io_t *io = allocate_or_die(sizeof(*io));
-	io->in      = h2_io_get_default;
-	io->out     = h2_io_set_default;
-	io->update  = h2_io_update_default;
-	io->soc     = h2_soc_state_new();
+int h2_io_register_input(h2_io_t * const io, const uint16_t addr, const h2_io_get get, void *param) {
+	assert(io);
+	if (!H2_IO_VALID(addr) || (addr & 1)) {
+		error("invalid input register: %04"PRIx16, addr);
+		return -1;
+	}
+	h2_io_input_t * const r = &io->in[H2_IO_INDEX(addr)];
+	r->get   = get ? get : h2_io_get_invalid;
+	r->param = param;
+	return 0;
+}
+
+int h2_io_register_output(h2_io_t * const io, const uint16_t addr, const h2_io_set set, void *param) {
+	assert(io);
+	if (!H2_IO_VALID(addr) || (addr & 1)) {
+		error("invalid output register: %04"PRIx16, addr);
+		return -1;
+	}
+	h2_io_output_t * const w = &io->out[H2_IO_INDEX(addr)];
+	w->set   = set ? set : h2_io_set_invalid;
+	w->param = param;
+	return 0;
+}
+
+int h2_io_register_peripheral(h2_io_t * const io, const h2_peripheral_t * const peripheral) {
+	assert(io);
+	assert(peripheral);
+	if (io->peripheral_count >= H2_PERIPHERALS_MAX) {
+		error("too many peripherals, cannot add %s", peripheral->name ? peripheral->name : "(unnamed)");
+		return -1;
+	}
+	h2_peripheral_t * const p = &io->peripherals[io->peripheral_count++];
+	*p = *peripheral;
+	p->period    = MAX(p->period, 1u);
+	p->countdown = p->period;
+	return 0;
+}
+
+#ifdef __unix__
+#include <dlfcn.h>
+
+int h2_io_plugin_load(h2_io_t * const io, const char * const name) {
+	assert(io);
+	assert(name);
+	int r = -1;
+	if (io->plugin_count >= H2_PLUGINS_MAX) {
+		error("too many plugins, cannot load %s", name);
+		return -1;
+	}
+	char *path = duplicate(name);
+	char *arguments = strchr(path, ',');
+	if (arguments)
+		*arguments++ = '\0';
+	void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		error("plugin load failed: %s", dlerror());
+		goto done;
+	}
+	h2_plugin_register_t registrar = NULL;
+	*(void**)(&registrar) = dlsym(handle, H2_PLUGIN_REGISTER); /* see dlsym(3) */
+	if (!registrar) {
+		error("plugin %s has no '%s': %s", path, H2_PLUGIN_REGISTER, dlerror());
+		dlclose(handle);
+		goto done;
+	}
+	io->plugins[io->plugin_count++] = handle;
+	if ((r = registrar(io, arguments ? arguments : "")) < 0)
+		error("plugin %s failed to register: %d", path, r);
+	else
+		note("loaded plugin %s", path);
+done:
+	free(path);
+	return r < 0 ? -1 : 0;
+}
+
+static void h2_io_plugin_close(void *handle) {
+	if (handle)
+		dlclose(handle);
+}
+#else
+int h2_io_plugin_load(h2_io_t * const io, const char * const name) {
+	assert(io);
+	assert(name);
+	error("plugins are not supported on this platform: %s", name);
+	return -1;
+}
+
+static void h2_io_plugin_close(void *handle) {
+	UNUSED(handle);
+}
+#endif
+
+h2_io_t *h2_io_new(void) {
+	h2_io_t *io = allocate_or_die(sizeof(*io));
+	h2_soc_state_t *soc = h2_soc_state_new();
+	io->soc = soc;
+	for (size_t i = 0; i <= H2_IO_REGISTERS; i++) {
+		io->in[i].get  = h2_io_get_invalid;
+		io->out[i].set = h2_io_set_invalid;
+	}
+
+	h2_io_register_input(io, iUart,     h2_io_get_uart,     NULL);
+	h2_io_register_input(io, iVT100,    h2_io_get_vt100,    NULL);
+	h2_io_register_input(io, iTimerDin, h2_io_get_register, &soc->timer);
+	h2_io_register_input(io, iSwitches, h2_io_get_register, &soc->switches);
+	h2_io_register_input(io, iMemDin,   h2_io_get_memory,   NULL);
+
+	h2_io_register_output(io, oUart,        h2_io_set_uart,           NULL);
+	h2_io_register_output(io, oVT100,       h2_io_set_vt100,          NULL);
+	h2_io_register_output(io, oTimerCtrl,   h2_io_set_register,       &soc->timer_control);
+	h2_io_register_output(io, oLeds,        h2_io_set_leds,           NULL);
+	h2_io_register_output(io, oMemDout,     h2_io_set_register,       &soc->mem_dout);
+	h2_io_register_output(io, oMemControl,  h2_io_set_memory_control, NULL);
+	h2_io_register_output(io, oMemAddrLow,  h2_io_set_register,       &soc->mem_addr_low);
+	h2_io_register_output(io, o7SegLED,     h2_io_set_register,       &soc->led_7_segments);
+	h2_io_register_output(io, oIrcMask,     h2_io_set_register,       &soc->irc_mask);
+	h2_io_register_output(io, oUartTxBaud,  h2_io_set_register,       &soc->uart_tx_baud);
+	h2_io_register_output(io, oUartRxBaud,  h2_io_set_register,       &soc->uart_rx_baud);
+	h2_io_register_output(io, oUartControl, h2_io_set_register,       &soc->uart_control);
+
+	h2_io_register_peripheral(io, &(h2_peripheral_t){ .name = "timer", .update = h2_timer_update, .period = 1 });
+	h2_io_register_peripheral(io, &(h2_peripheral_t){ .name = "dpad",  .update = h2_dpad_update,  .period = 1 });
+	h2_io_register_peripheral(io, &(h2_peripheral_t){ .name = "flash", .update = h2_flash_update, .period = 1 });
 	return io;
 }
 
 void h2_io_free(h2_io_t *io) {
 	if (!io)
 		return;
+	for (size_t i = 0; i < io->peripheral_count; i++)
+		if (io->peripherals[i].free)
+			io->peripherals[i].free(io->peripherals[i].param);
+	for (size_t i = 0; i < io->plugin_count; i++)
+		h2_io_plugin_close(io->plugins[i]);
 	h2_soc_state_free(io->soc);
 	memset(io, 0, sizeof(*io));
 	free(io);
@@ -2130,7 +2608,7 @@ again:
 				fprintf(ds->output, "I/O unavailable\n");
 				break;
 			}
-			io->out(io->soc, num1, num2, NULL);
+			h2_io_write(io, num1, num2, NULL);
 
 			break;
 
@@ -2139,7 +2617,7 @@ again:
 				fprintf(ds->output, "I/O unavailable\n");
 				break;
 			}
-			fprintf(ds->output, "read: %"PRIx16"\n", io->in(io->soc, num1, NULL));
+			fprintf(ds->output, "read: %"PRIx16"\n", h2_io_read(io, num1, NULL));
 			break;
 
 		case 'k':
@@ -2168,9 +2646,10 @@ again:
 				fprintf(ds->output, "I/O unavailable\n");
 				break;
 			}
+			h2_terminal_sync(io->soc);
 			for (size_t i = 0; i < VGA_HEIGHT; i++) {
 				for (size_t j = 0; j < VGA_WIDTH; j++) {
-					unsigned char c = io->soc->vt100.m[i*VGA_WIDTH + j];
+					unsigned char c = vt100_char(&io->soc->vt100, i*VGA_WIDTH + j);
 					fputc(c < 32 || c > 127 ? '?' : c, ds->output);
 				}
 				fputc('\n', ds->output);
@@ -2194,6 +2673,152 @@ again:
 	return 0;
 }
 
+static const char *instruction_class_names[] = {
+#define X(ENUM, NAME) [ENUM] = NAME,
+	X_MACRO_INSTRUCTION_CLASSES
+#undef X
+};
+
+const char *h2_io_register_name(const uint16_t addr, const bool output) {
+	if (output) {
+		switch (addr) {
+#define X(NAME, ADDRESS) case NAME: return #NAME;
+		X_MACRO_OUTPUT_REGISTERS
+#undef X
+		}
+	} else {
+		switch (addr) {
+#define X(NAME, ADDRESS) case NAME: return #NAME;
+		X_MACRO_INPUT_REGISTERS
+#undef X
+		}
+	}
+	return NULL;
+}
+
+static void h2_stats_interrupt(h2_stats_t * const s, const uint16_t vector) {
+	assert(s);
+	assert(vector < NUMBER_OF_INTERRUPTS);
+	const uint64_t latency = s->interrupt_pending ? s->cycles - s->interrupt_raised : 0;
+	s->interrupts[vector]++;
+	s->interrupt_latency[vector] += latency;
+	s->interrupt_latency_max[vector] = MAX(s->interrupt_latency_max[vector], latency);
+	s->interrupt_pending = false;
+}
+
+static uint64_t h2_stats_instructions(const h2_stats_t * const s) {
+	assert(s);
+	uint64_t r = 0;
+	for (size_t i = 0; i < INSTRUCTION_CLASS_MAX; i++)
+		r += s->instructions[i];
+	return r;
+}
+
+static int h2_stats_print_text(FILE *out, const h2_t * const h, const h2_io_t * const io, const double seconds) {
+	const h2_stats_t * const s = &h->stats;
+	const uint64_t executed = h2_stats_instructions(s);
+	const double mips = seconds > 0. ? ((double)executed / seconds) / 1e6 : 0.;
+
+	fprintf(out, "cycles:           %"PRIu64"\n", s->cycles);
+	fprintf(out, "wait cycles:      %"PRIu64"\n", s->waits);
+	fprintf(out, "wall time:        %.3fs\n",     seconds);
+	fprintf(out, "MIPS:             %.3f\n",      mips);
+	fprintf(out, "instructions:     %"PRIu64"\n", executed);
+	for (size_t i = 0; i < INSTRUCTION_CLASS_MAX; i++)
+		fprintf(out, "  %-15s %"PRIu64"\n", instruction_class_names[i], s->instructions[i]);
+	fprintf(out, "rp max:           %u\n", (unsigned)h->rpm);
+	fprintf(out, "sp max:           %u\n", (unsigned)h->spm);
+	fputs("I/O reads:\n", out);
+	for (uint16_t i = 0; i < H2_IO_REGISTERS; i++) {
+		const char *name = h2_io_register_name(0x4000 | (i << 1), false);
+		if (name || s->io_reads[i])
+			fprintf(out, "  %-15s %"PRIu64"\n", name ? name : "unknown", s->io_reads[i]);
+	}
+	if (s->io_reads[H2_IO_REGISTERS])
+		fprintf(out, "  %-15s %"PRIu64"\n", "invalid", s->io_reads[H2_IO_REGISTERS]);
+	fputs("I/O writes:\n", out);
+	for (uint16_t i = 0; i < H2_IO_REGISTERS; i++) {
+		const char *name = h2_io_register_name(0x4000 | (i << 1), true);
+		if (name || s->io_writes[i])
+			fprintf(out, "  %-15s %"PRIu64"\n", name ? name : "unknown", s->io_writes[i]);
+	}
+	if (s->io_writes[H2_IO_REGISTERS])
+		fprintf(out, "  %-15s %"PRIu64"\n", "invalid", s->io_writes[H2_IO_REGISTERS]);
+	fputs("interrupts (count, mean latency, max latency):\n", out);
+	for (size_t i = 0; i < NUMBER_OF_INTERRUPTS; i++) {
+		const double mean = s->interrupts[i] ? (double)s->interrupt_latency[i] / (double)s->interrupts[i] : 0.;
+		fprintf(out, "  %u               %"PRIu64" %.2f %"PRIu64"\n", (unsigned)i, s->interrupts[i], mean, s->interrupt_latency_max[i]);
+	}
+	if (io) {
+		fprintf(out, "flash programs:   %"PRIu64"\n", io->soc->flash.programs);
+		fprintf(out, "flash erases:     %"PRIu64"\n", io->soc->flash.erases);
+	}
+	return fflush(out) < 0 ? -1 : 0;
+}
+
+/* JSON output is kept on a single line so it can be appended to a log file
+ * as a stream of records, one per metrics interval */
+static int h2_stats_print_json(FILE *out, const h2_t * const h, const h2_io_t * const io, const double seconds) {
+	const h2_stats_t * const s = &h->stats;
+	const uint64_t executed = h2_stats_instructions(s);
+	const double mips = seconds > 0. ? ((double)executed / seconds) / 1e6 : 0.;
+	const char *sep = "";
+
+	fprintf(out, "{\"cycles\":%"PRIu64",\"waits\":%"PRIu64",\"seconds\":%.6f,\"mips\":%.3f,", s->cycles, s->waits, seconds, mips);
+	fputs("\"instructions\":{", out);
+	for (size_t i = 0; i < INSTRUCTION_CLASS_MAX; i++, sep = ",")
+		fprintf(out, "%s\"%s\":%"PRIu64, sep, instruction_class_names[i], s->instructions[i]);
+	fprintf(out, "},\"rpm\":%u,\"spm\":%u,", (unsigned)h->rpm, (unsigned)h->spm);
+	fputs("\"io_reads\":{", out);
+	sep = "";
+	for (uint16_t i = 0; i < H2_IO_REGISTERS; i++) {
+		const char *name = h2_io_register_name(0x4000 | (i << 1), false);
+		if (name || s->io_reads[i])
+			fprintf(out, "%s\"%s\":%"PRIu64, sep, name ? name : "unknown", s->io_reads[i]), sep = ",";
+	}
+	if (s->io_reads[H2_IO_REGISTERS])
+		fprintf(out, "%s\"invalid\":%"PRIu64, sep, s->io_reads[H2_IO_REGISTERS]);
+	fputs("},\"io_writes\":{", out);
+	sep = "";
+	for (uint16_t i = 0; i < H2_IO_REGISTERS; i++) {
+		const char *name = h2_io_register_name(0x4000 | (i << 1), true);
+		if (name || s->io_writes[i])
+			fprintf(out, "%s\"%s\":%"PRIu64, sep, name ? name : "unknown", s->io_writes[i]), sep = ",";
+	}
+	if (s->io_writes[H2_IO_REGISTERS])
+		fprintf(out, "%s\"invalid\":%"PRIu64, sep, s->io_writes[H2_IO_REGISTERS]);
+	fputs("},\"interrupts\":[", out);
+	sep = "";
+	for (size_t i = 0; i < NUMBER_OF_INTERRUPTS; i++, sep = ",")
+		fprintf(out, "%s{\"count\":%"PRIu64",\"latency\":%"PRIu64",\"latency_max\":%"PRIu64"}",
+			sep, s->interrupts[i], s->interrupt_latency[i], s->interrupt_latency_max[i]);
+	fputc(']', out);
+	if (io)
+		fprintf(out, ",\"flash_programs\":%"PRIu64",\"flash_erases\":%"PRIu64, io->soc->flash.programs, io->soc->flash.erases);
+	fputs("}\n", out);
+	return fflush(out) < 0 ? -1 : 0;
+}
+
+int h2_stats_print(FILE *out, const h2_t * const h, const h2_io_t * const io, const double seconds, const bool json) {
+	assert(out);
+	assert(h);
+	return json ?
+		h2_stats_print_json(out, h, io, seconds) :
+		h2_stats_print_text(out, h, io, seconds);
+}
+
+int h2_profile_print(FILE *out, const h2_t * const h) {
+	assert(out);
+	assert(h);
+	if (!h->profile)
+		return -1;
+	for (size_t i = 0; i < MAX_CORE; i++)
+		if (h->profile[i])
+			if (fprintf(out, "%04x %"PRIu64"\n", (unsigned)i, h->profile[i]) < 0)
+				return -1;
+	return fflush(out) < 0 ? -1 : 0;
+}
+
 static uint16_t interrupt_decode(uint8_t *vector) {
 	for (unsigned i = 0; i < NUMBER_OF_INTERRUPTS; i++)
 		if (*vector & (1u << i)) {
@@ -2226,14 +2851,23 @@ int h2_run(h2_t *h, h2_io_t *io, FILE *output, const unsigned steps, symbol_tabl
 
 		if (run_debugger)
 			if (h2_debugger(&ds, h, io, symbols, h->pc))
-				return 0;
+				return 1;
 
 		h->time++;
+		h->stats.cycles++;
 
 		if (io) {
-			io->update(io->soc);
-			if (io->soc->wait)
+			h2_io_update_peripherals(io);
+			if (io->soc->interrupt && !h->stats.interrupt_pending) {
+				h->stats.interrupt_pending = true;
+				h->stats.interrupt_raised  = h->stats.cycles;
+			}
+			if (io->soc->wait) {
+				h->stats.waits++;
 				continue; /* wait only applies to the H2 core not the rest of the SoC */
+			}
+			if (io->soc->halt)
+				return -1;
 		}
 
 		if (h->pc >= MAX_CORE) {
@@ -2241,6 +2875,7 @@ int h2_run(h2_t *h, h2_io_t *io, FILE *output, const unsigned steps, symbol_tabl
 			return -1;
 		}
 		instruction = h->core[h->pc];
+		tracepoint(TRACE_CPU, "pc %04"PRIx16" inst %04"PRIx16" tos %04"PRIx16" sp %u rp %u", h->pc, instruction, h->tos, (unsigned)h->sp, (unsigned)h->rp);
 
 		literal = instruction & 0x7FFF;
 		address = instruction & 0x1FFF; /* NB. also used for ALU OP */
@@ -2249,14 +2884,18 @@ int h2_run(h2_t *h, h2_io_t *io, FILE *output, const unsigned steps, symbol_tabl
 			rpush(h, h->pc << 1);
 			io->soc->interrupt = false;
 			h->pc = interrupt_decode(&io->soc->interrupt_selector);
+			h2_stats_interrupt(&h->stats, h->pc);
 			continue;
 		}
 
 		pc_plus_one = (h->pc + 1) % MAX_CORE;
+		if (h->profile)
+			h->profile[h->pc]++;
 
 		/* NB. This is not quite what the hardware is doing, but it should be equivalent */
 		/* decode / execute */
 		if (IS_LITERAL(instruction)) { /* The hardware actually uses ALU_OP_LITERAL */
+			h->stats.instructions[INSTRUCTION_CLASS_LITERAL]++;
 			dpush(h, literal);
 			h->pc = pc_plus_one;
 		} else if (IS_ALU_OP(instruction)) {
@@ -2265,6 +2904,7 @@ int h2_run(h2_t *h, h2_io_t *io, FILE *output, const unsigned steps, symbol_tabl
 			const uint16_t nos = h->dstk[h->sp % STK_SIZE];
 			uint16_t npc = pc_plus_one;
 			uint16_t tos = h->tos;
+			h->stats.instructions[INSTRUCTION_CLASS_ALU]++;
 
 			if (instruction & R_TO_PC)
 				npc = h->rstk[h->rp % STK_SIZE] >> 1;
@@ -2287,7 +2927,9 @@ int h2_run(h2_t *h, h2_io_t *io, FILE *output, const unsigned steps, symbol_tabl
 					if (io) {
 						if (h->tos & 0x1)
 							warning("unaligned register read: %04x", (unsigned)h->tos);
-						tos = io->in(io->soc, h->tos & ~0x1, &turn_debug_on);
+						h->stats.io_reads[H2_IO_SLOT(h->tos & ~0x1)]++;
+						tos = h2_io_read(io, h->tos & ~0x1, &turn_debug_on);
+						tracepoint(TRACE_IO_READ, "addr %04"PRIx16" -> %04"PRIx16, h->tos, tos);
 						if (turn_debug_on) {
 							ds.step = true;
 							run_debugger = true;
@@ -2334,7 +2976,9 @@ int h2_run(h2_t *h, h2_io_t *io, FILE *output, const unsigned steps, symbol_tabl
 					if (io) {
 						if (h->tos & 0x1)
 							warning("unaligned register write: %04x <- %04x", (unsigned)h->tos, (unsigned)nos);
-						io->out(io->soc, h->tos & ~0x1, nos, &turn_debug_on);
+						h->stats.io_writes[H2_IO_SLOT(h->tos & ~0x1)]++;
+						tracepoint(TRACE_IO_WRITE, "addr %04"PRIx16" <- %04"PRIx16, h->tos, nos);
+						h2_io_write(io, h->tos & ~0x1, nos, &turn_debug_on);
 						if (turn_debug_on) {
 							ds.step = true;
 							run_debugger = true;
@@ -2351,14 +2995,17 @@ int h2_run(h2_t *h, h2_io_t *io, FILE *output, const unsigned steps, symbol_tabl
 			h->tos = tos;
 			h->pc = npc;
 		} else if (IS_CALL(instruction)) {
+			h->stats.instructions[INSTRUCTION_CLASS_CALL]++;
 			rpush(h, pc_plus_one << 1);
 			h->pc = address;
 		} else if (IS_0BRANCH(instruction)) {
+			h->stats.instructions[INSTRUCTION_CLASS_0BRANCH]++;
 			if (!dpop(h))
 				h->pc = address % MAX_CORE;
 			else
 				h->pc = pc_plus_one;
 		} else if (IS_BRANCH(instruction)) {
+			h->stats.instructions[INSTRUCTION_CLASS_BRANCH]++;
 			h->pc = address;
 		} else {
 			error("invalid instruction: %"PRId16, instruction);
@@ -2372,159 +3019,1765 @@ int h2_run(h2_t *h, h2_io_t *io, FILE *output, const unsigned steps, symbol_tabl
 
 /* ========================== Simulation And Debugger ====================== */
 
-/* ========================== Main ========================================= */
+/* ========================== Shared Memory Introspection ================== */
 
-#ifndef NO_MAIN
-typedef enum {
-	DEFAULT_COMMAND,
-	DISASSEMBLE_COMMAND,
-	RUN_COMMAND,
-} command_e;
+/* A running simulation can publish its state to a POSIX shared memory
+ * segment, this is cheap to do every few hundred thousand cycles and allows
+ * any number of instances to be watched by 'h2top' without stopping them.
+ * The update is guarded by a sequence lock, the writer never waits on the
+ * readers. */
 
-typedef struct {
-	command_e cmd;
-	long steps;
-	bool full_disassembly;
-	bool debug_mode;
-	bool hacks;
-	disassemble_color_method_e dcm;
-	const char *nvram;
-} command_args_t;
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-static const char *help = "\
-usage ./h2 [-hvdDarRTH] [-sc number] [-L symbol.file] [-S symbol.file] [-e file.fth] (file.hex|file.fth)\n\n\
-Brief:     A H2 CPU Assembler, disassembler and Simulator.\n\
-Author:    Richard James Howe\n\
-Site:      https://github.com/howerj/forth-cpu\n\
-License:   MIT\n\
-Copyright: Richard James Howe (2017,2018)\n\
-Options:\n\n\
-\t-\tstop processing options, following arguments are files\n\
-\t-h\tprint this help message and exit\n\
-\t-v\tincrease logging level\n\
-\t-d\tdisassemble input files (default)\n\
-\t-D\tfull disassembly of input files\n\
-\t-T\tEnter debug mode when running simulation\n\
-\t-H\tenable hacks to make the simulation easier to use\n\
-\t-r\trun hex file\n\
-\t-L #\tload symbol file\n\
-\t-S #\tsave symbols to file\n\
-\t-s #\tnumber of steps to run simulation (0 = forever)\n\
-\t-n #\tspecify nvram file\n\
-\t-H #\tenable certain hacks for simulation purposes\n\
-\t-c #\tset colorization method for disassembly\n\
-\tfile\thex or forth file to process\n\n\
-Options must precede any files given, if a file has not been\n\
-given as arguments input is taken from stdin. Output is to\n\
-stdout. Program returns zero on success, non zero on failure.\n\n\
-";
+static h2_shm_t *h2_shm_map(const char *name, const bool owner) {
+	assert(name);
+	const int flags = owner ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY;
+	errno = 0;
+	const int fd = shm_open(name, flags, 0644);
+	if (fd < 0) {
+		error("shm_open %s failed: %s", name, reason());
+		return NULL;
+	}
+	if (owner && ftruncate(fd, sizeof(h2_shm_snapshot_t)) < 0) {
+		error("ftruncate %s failed: %s", name, reason());
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	void *m = mmap(NULL, sizeof(h2_shm_snapshot_t), owner ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		error("mmap %s failed: %s", name, reason());
+		if (owner)
+			shm_unlink(name);
+		return NULL;
+	}
+	h2_shm_t *shm = allocate_or_die(sizeof(*shm));
+	shm->name     = duplicate(name);
+	shm->snapshot = m;
+	shm->owner    = owner;
+	return shm;
+}
 
-static void debug_note(const command_args_t * const cmd) {
-	assert(cmd);
-	if (cmd->debug_mode)
-		note("entering debug mode");
-	else
-		note("running for %u cycles (0 = forever)", (unsigned)cmd->steps);
+h2_shm_t *h2_shm_new(const char *name) {
+	char pid_name[64] = { 0 };
+	if (!name) {
+		sprintf(pid_name, "%s%ld", H2_SHM_PREFIX, (long)getpid());
+		name = pid_name;
+	}
+	h2_shm_t *shm = h2_shm_map(name, true);
+	if (!shm)
+		return NULL;
+	h2_shm_snapshot_t *s = shm->snapshot;
+	s->version = H2_SHM_VERSION;
+	s->pid     = getpid();
+	H2_STORE_RELEASE(&s->magic, (uint32_t)H2_SHM_MAGIC);
+	return shm;
 }
 
-static int run_command(const command_args_t * const cmd, FILE *input, FILE *output, symbol_table_t *symbols, uint16_t *vga_initial_contents) {
-	assert(input);
-	assert(output);
-	assert(cmd);
-	assert(cmd->nvram);
-	int r = 0;
+h2_shm_t *h2_shm_attach(const char *name) {
+	return h2_shm_map(name, false);
+}
 
-	h2_t *h = h2_new(START_ADDR);
-	if (h2_load(h, input) < 0)
-		return -1;
+void h2_shm_free(h2_shm_t *shm) {
+	if (!shm)
+		return;
+	munmap(shm->snapshot, sizeof(h2_shm_snapshot_t));
+	if (shm->owner)
+		shm_unlink(shm->name);
+	free(shm->name);
+	free(shm);
+}
+#else
+h2_shm_t *h2_shm_new(const char *name) {
+	UNUSED(name);
+	error("shared memory introspection is not supported on this platform");
+	return NULL;
+}
 
-	if (!h)
-		return -1;
+h2_shm_t *h2_shm_attach(const char *name) {
+	return h2_shm_new(name);
+}
 
-	h2_io_t * const io = h2_io_new();
-	assert(VGA_BUFFER_LENGTH <= VT100_MAX_SIZE);
-	for (size_t i = 0; i < VGA_BUFFER_LENGTH; i++) {
-		vt100_attribute_t attr;
-		memset(&attr, 0, sizeof(attr));
-		io->soc->vt100.m[i]   =  vga_initial_contents[i] & 0xff;
-		attr.background_color = (vga_initial_contents[i] >> 8)  & 0x7;
-		attr.foreground_color = (vga_initial_contents[i] >> 11) & 0x7;
-		memcpy(&io->soc->vt100.attributes[i], &attr, sizeof(attr));
-	}
+void h2_shm_free(h2_shm_t *shm) {
+	UNUSED(shm);
+}
+#endif
 
-	nvram_load_and_transfer(io, cmd->nvram, cmd->hacks);
-	h->pc = START_ADDR;
-	debug_note(cmd);
-	r = h2_run(h, io, output, cmd->steps, symbols, cmd->debug_mode, NULL);
-	nvram_save(io, cmd->nvram);
+void h2_shm_publish(h2_shm_t *shm, const h2_t * const h, const h2_io_t * const io, const double seconds, const bool exited) {
+	if (!shm)
+		return;
+	assert(shm->owner);
+	assert(h);
+	h2_shm_snapshot_t * const s = shm->snapshot;
+	const uint32_t sequence = H2_LOAD_RELAXED(&s->sequence);
+
+	H2_STORE_RELAXED(&s->sequence, sequence + 1u);
+	H2_FENCE_RELEASE();
+
+	s->exited  = exited;
+	s->seconds = seconds;
+	s->stats   = h->stats;
+	s->pc      = h->pc;
+	s->tos     = h->tos;
+	s->rp      = h->rp;
+	s->sp      = h->sp;
+	s->rpm     = h->rpm;
+	s->spm     = h->spm;
+	s->ie      = h->ie;
+	memcpy(s->rstk, h->rstk, sizeof(s->rstk));
+	memcpy(s->dstk, h->dstk, sizeof(s->dstk));
+	if (io) {
+		h2_terminal_sync(io->soc);
+		const h2_soc_state_t * const soc = io->soc;
+		const vt100_t * const v = &soc->vt100;
+		s->leds               = soc->leds;
+		s->led_7_segments     = soc->led_7_segments;
+		s->switches           = soc->switches;
+		s->timer_control      = soc->timer_control;
+		s->timer              = soc->timer;
+		s->irc_mask           = soc->irc_mask;
+		s->interrupt_selector = soc->interrupt_selector;
+		s->mem_control        = soc->mem_control;
+		s->mem_addr_low       = soc->mem_addr_low;
+		s->mem_dout           = soc->mem_dout;
+		s->uart_tx_baud       = soc->uart_tx_baud;
+		s->uart_rx_baud       = soc->uart_rx_baud;
+		s->uart_control       = soc->uart_control;
+		s->flash_mode         = soc->flash.mode;
+		s->flash_status       = soc->flash.status;
+		s->flash_programs     = soc->flash.programs;
+		s->flash_erases       = soc->flash.erases;
+		s->vt100_width        = v->width;
+		s->vt100_height       = v->height;
+		s->vt100_cursor       = v->cursor;
+		for (size_t i = 0; i < MIN((size_t)VGA_AREA, (size_t)v->size); i++)
+			s->screen[i] = vt100_cell(v, i);
+	}
 
-	h2_free(h);
-	h2_io_free(io);
-	return r;
+	H2_STORE_RELEASE(&s->sequence, sequence + 2u);
 }
 
-int command(const command_args_t * const cmd, FILE *input, FILE *output, symbol_table_t *symbols, uint16_t *vga_initial_contents) {
-	assert(input);
-	assert(output);
-	assert(cmd);
-	assert(vga_initial_contents);
-	switch (cmd->cmd) {
-	case DEFAULT_COMMAND:      /* fall through */
-	case DISASSEMBLE_COMMAND:  return h2_disassemble(cmd->dcm, input, output, symbols);
-	case RUN_COMMAND:          return run_command(cmd, input, output, symbols, vga_initial_contents);
-	default:                   fatal("invalid command: %d", cmd->cmd);
+int h2_shm_read(const h2_shm_t * const shm, h2_shm_snapshot_t *copy) {
+	assert(shm);
+	assert(copy);
+	const h2_shm_snapshot_t * const s = shm->snapshot;
+	if (H2_LOAD_ACQUIRE(&s->magic) != H2_SHM_MAGIC || s->version != H2_SHM_VERSION)
+		return -1;
+	for (unsigned tries = 0; tries < 1000; tries++) {
+		const uint32_t before = H2_LOAD_ACQUIRE(&s->sequence);
+		if (before & 1u)
+			continue;
+		memcpy(copy, s, sizeof(*copy));
+		H2_FENCE_ACQUIRE();
+		if (H2_LOAD_RELAXED(&s->sequence) == before)
+			return 0;
 	}
 	return -1;
 }
 
-static const char *nvram_file = FLASH_INIT_FILE;
+/* ========================== Shared Memory Introspection ================== */
 
-int h2_main(int argc, char **argv) {
-	int i;
-	const char *optarg = NULL;
-	command_args_t cmd;
-	symbol_table_t *symbols = NULL;
-	FILE *symfile = NULL;
-	FILE *input = NULL;
-	memset(&cmd, 0, sizeof(cmd));
-	cmd.steps = DEFAULT_STEPS;
-	cmd.nvram = nvram_file;
-	cmd.dcm   = DCM_X11;
+/* ========================== Framebuffer ================================== */
 
-	static uint16_t vga_initial_contents[VGA_BUFFER_LENGTH] = { 0 };
+/* The terminal is drawn with the glyphs of the font ROM as the VGA module
+ * would, but into memory, so screens can be captured by a headless
+ * simulation. Each line of a glyph is one byte, the eight pixels it expands
+ * to depend only on that byte and on the colours of the cell, so the
+ * expansion is cached per colour pair and a glyph line is drawn with one
+ * small copy. The colours match those of the GUI. */
 
-	binary(stdin);
-	binary(stdout);
-	binary(stderr);
+#define FRAMEBUFFER_PAIRS (128) /* background, foreground and bold bits of a cell */
+#define FRAMEBUFFER_LINE  (VGA_FONT_WIDTH * 3)
 
-	{ /* attempt to load initial contents of VGA memory */
-		errno = 0;
-		FILE *vga_init = fopen(VGA_INIT_FILE, "rb");
-		if (vga_init) {
-			memory_load(vga_init, vga_initial_contents, VGA_BUFFER_LENGTH);
-			fclose(vga_init);
-		} else {
-			warning("could not load initial VGA memory file %s: %s", VGA_INIT_FILE, strerror(errno));
+struct h2_framebuffer {
+	uint8_t glyphs[VGA_FONT_GLYPHS][VGA_FONT_HEIGHT];
+	uint8_t lines[FRAMEBUFFER_PAIRS][256][FRAMEBUFFER_LINE];
+	bool built[FRAMEBUFFER_PAIRS];
+	unsigned width, height; /* of the last render, in pixels */
+	uint8_t *pixels;
+	size_t allocated;
+};
+
+int h2_font_load(const char *file, uint8_t glyphs[VGA_FONT_GLYPHS][VGA_FONT_HEIGHT]) {
+	assert(file);
+	assert(glyphs);
+	errno = 0;
+	FILE *font = fopen(file, "rb");
+	if (!font)
+		return -1;
+	int r = 0;
+	for (size_t line = 0; line < (VGA_FONT_GLYPHS * VGA_FONT_HEIGHT); line++) {
+		char buf[80] = { 0 };
+		if (!fgets(buf, sizeof(buf), font) || strspn(buf, "01") < VGA_FONT_WIDTH) {
+			r = -1;
+			break;
 		}
+		uint8_t bits = 0;
+		for (size_t x = 0; x < VGA_FONT_WIDTH; x++)
+			bits = (bits << 1) | (buf[x] == '1');
+		glyphs[line / VGA_FONT_HEIGHT][line % VGA_FONT_HEIGHT] = bits;
 	}
+	fclose(font);
+	return r;
+}
 
-	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+h2_framebuffer_t *h2_framebuffer_new(const char *font) {
+	assert(font);
+	h2_framebuffer_t *f = allocate_or_die(sizeof(*f));
+	if (h2_font_load(font, f->glyphs) < 0) {
+		free(f);
+		return NULL;
+	}
+	return f;
+}
 
-		if (strlen(argv[i]) > 2) {
-			error("Only one option allowed at a time (got %s)", argv[i]);
-			goto fail;
+void h2_framebuffer_free(h2_framebuffer_t *f) {
+	if (!f)
+		return;
+	free(f->pixels);
+	free(f);
+}
+
+static void framebuffer_color(uint8_t rgb[3], const unsigned color, const uint8_t on) {
+	rgb[0] = color & 1 ? on : 0;
+	rgb[1] = color & 2 ? on : 0;
+	rgb[2] = color & 4 ? on : 0;
+}
+
+static const uint8_t *framebuffer_line(h2_framebuffer_t *f, const unsigned pair, const uint8_t bits) {
+	assert(f);
+	assert(pair < FRAMEBUFFER_PAIRS);
+	if (!f->built[pair]) {
+		uint8_t background[3], foreground[3];
+		framebuffer_color(background, pair & 7, 255);
+		framebuffer_color(foreground, (pair >> 3) & 7, (pair >> 6) & 1 ? 204 : 102);
+		for (unsigned b = 0; b < 256; b++)
+			for (unsigned x = 0; x < VGA_FONT_WIDTH; x++)
+				memcpy(&f->lines[pair][b][x * 3], (b << x) & 0x80 ? foreground : background, 3);
+		f->built[pair] = true;
+	}
+	return f->lines[pair][bits];
+}
+
+const uint8_t *h2_framebuffer_render(h2_framebuffer_t *f, const vt100_t *t, const bool blink_on, unsigned *width, unsigned *height) {
+	assert(f);
+	assert(t);
+	const unsigned w = t->width * VGA_FONT_WIDTH, h = t->height * VGA_FONT_HEIGHT;
+	const size_t stride = (size_t)w * 3, size = stride * h;
+	if (size > f->allocated) {
+		free(f->pixels);
+		f->pixels = allocate_or_die(size);
+		f->allocated = size;
+	}
+	f->width = w;
+	f->height = h;
+	const bool cursor = t->cursor_on && (!t->blinks || blink_on);
+	for (unsigned y = 0; y < t->height; y++) {
+		const uint16_t *const cells = vt100_row(t, y);
+		uint8_t *const row = &f->pixels[y * VGA_FONT_HEIGHT * stride];
+		for (unsigned x = 0; x < t->width; x++) {
+			const uint16_t cell = cells[x];
+			const unsigned pair = (cell >> 8) & (FRAMEBUFFER_PAIRS - 1);
+			const uint8_t *const glyph = f->glyphs[VT100_CELL_CHARACTER(cell)];
+			const uint8_t mask   = blink_on && (cell & VT100_CELL_BLINK) ? 0x00 : 0xFF;
+			const uint8_t invert = cursor && ((size_t)y * t->width) + x == t->cursor ? 0xFF : 0x00;
+			uint8_t *p = &row[x * FRAMEBUFFER_LINE];
+			for (unsigned j = 0; j < VGA_FONT_HEIGHT; j++, p += stride)
+				memcpy(p, framebuffer_line(f, pair, (glyph[j] & mask) ^ invert), FRAMEBUFFER_LINE);
 		}
+	}
+	if (width)
+		*width = w;
+	if (height)
+		*height = h;
+	return f->pixels;
+}
 
-		switch (argv[i][1]) {
-		case '\0':
-			goto done; /* stop processing options */
-		case 'h':
-			fprintf(stderr, "%s\n", help);
-			return -1;
-		case 'v':  /* increase verbosity */
-			log_level += log_level < LOG_ALL_MESSAGES ? 1 : 0;
-			break;
-		case 'D':
+int h2_framebuffer_save(const h2_framebuffer_t *f, FILE *output) {
+	assert(f);
+	assert(output);
+	const size_t size = (size_t)f->width * f->height * 3;
+	if (fprintf(output, "P6\n%u %u\n255\n", f->width, f->height) < 0)
+		return -1;
+	return fwrite(f->pixels, 1, size, output) == size ? 0 : -1;
+}
+
+/* ========================== Framebuffer ================================== */
+
+/* ========================== Console ====================================== */
+
+/* The default UART handlers block the entire simulation in 'wrap_getch'
+ * until a character arrives. The console instead runs a reader thread that
+ * fills a FIFO with the same depth as the one in the hardware, so the UART
+ * status register reports an empty receive FIFO correctly and the CPU, its
+ * timers and interrupts keep running. Output is buffered and written out on
+ * a new line, when the buffer fills, when the program is idle waiting for
+ * input or every CONSOLE_FLUSH_CYCLES.
+ *
+ * A console can be connected to the terminal, to a pseudo terminal that
+ * programs expecting a serial port can open, or to a unix socket. By default
+ * characters move as fast as the host allows, when paced the UART instead
+ * takes as many cycles per character as it would on the board at the baud
+ * rate programmed into 'oUartTxBaud' and 'oUartRxBaud'.
+ *
+ * An escape character on the terminal drops the simulation into the
+ * debugger, which reads standard input itself, so the reader thread stops
+ * when it sees one and the console falls back to blocking reads. */
+
+#define CONSOLE_TX_BUFFER     (4096u)
+#define CONSOLE_FLUSH_CYCLES  (100000u)  /**< maximum cycles output is held for */
+#define CONSOLE_PACE_CYCLES   (64u)      /**< granularity of UART pacing */
+#define CONSOLE_IDLE_POLLS    (1024u)    /**< empty receive polls before idling */
+#define CONSOLE_IDLE_WAIT_NS  (1000000l) /**< longest idle wait for input */
+#define CONSOLE_POLL_MS       (50)       /**< reader thread checks for stop this often */
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+struct h2_console {
+	int input, output; /**< guarded by 'lock', -1 when no client is connected */
+	int listener;      /**< unix socket accepting clients, or -1 */
+	int slave;         /**< pseudo terminal slave, kept open so the master never hangs up */
+	char *path;        /**< socket or symbolic link to remove when done */
+	pthread_t reader;
+	pthread_mutex_t lock; /**< only needed for the waits and changing clients */
+	pthread_cond_t readable, writable;
+	fifo_t *rx;     /**< reader thread produces, simulation consumes */
+	bool eof;       /**< atomic, input has been exhausted */
+	bool escaped;   /**< atomic, reader stopped at an escape */
+	bool stop;      /**< atomic, reader should exit */
+	bool running, raw, terminal;
+	struct termios cooked;
+	uint8_t stash[256]; /**< input read after an escape */
+	size_t stash_length, stash_index;
+	unsigned idle;
+	bool paced;
+	bool sleeps; /* wait for input when the program has been polling for a while */
+	bool exits;  /* call 'exit' at the end of input, the CLI has nothing else to do */
+	uint64_t cycles;   /**< advanced by the pacing peripheral */
+	uint64_t rx_next;  /**< cycle at which the next character can be received */
+	uint64_t tx_next;  /**< cycle at which the next character has been sent */
+	unsigned tx_count; /**< characters in the modelled transmit FIFO */
+	size_t tx_length;
+	uint8_t tx[CONSOLE_TX_BUFFER];
+};
+
+/* Each 8N1 character is ten bits, a bit lasts sixteen ticks of the sample
+ * clock, which ticks every 'divisor + 1' cycles (see 'uart.vhd'). */
+static uint64_t console_character_cycles(const uint16_t divisor) {
+	const uint64_t d = divisor ? divisor : (CLOCK_SPEED_HZ / (UART_BAUD_RATE * 16)) - 1;
+	return 10 * 16 * (d + 1);
+}
+
+static void console_cooked(h2_console_t * const c) {
+	assert(c);
+	if (c->raw)
+		tcsetattr(c->input, TCSANOW, &c->cooked);
+	c->raw = false;
+}
+
+void h2_console_flush(h2_console_t * const c) {
+	if (!c || !c->tx_length)
+		return;
+	pthread_mutex_lock(&c->lock); /* a client may be disconnecting */
+	for (size_t i = 0; c->output >= 0 && i < c->tx_length;) {
+		const ssize_t r = write(c->output, c->tx + i, c->tx_length - i);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			if (c->listener < 0)
+				warning("console write failed: %s", reason());
+			break;
+		}
+		i += r;
+	}
+	pthread_mutex_unlock(&c->lock);
+	c->tx_length = 0;
+}
+
+static void console_putc(h2_console_t * const c, const uint8_t ch) {
+	assert(c);
+	c->tx[c->tx_length++] = ch;
+	if (ch == '\n' || c->tx_length >= CONSOLE_TX_BUFFER)
+		h2_console_flush(c);
+}
+
+/* Wait a while for a client to connect to the socket, the reader checks
+ * whether it has been stopped between each wait. */
+static void console_accept(h2_console_t * const c) {
+	assert(c);
+	struct pollfd p = { .fd = c->listener, .events = POLLIN };
+	if (poll(&p, 1, CONSOLE_POLL_MS) <= 0)
+		return;
+	const int client = accept(c->listener, NULL, NULL);
+	if (client < 0)
+		return;
+	pthread_mutex_lock(&c->lock);
+	c->input = client;
+	c->output = client;
+	pthread_mutex_unlock(&c->lock);
+	note("console client connected on %s", c->path);
+}
+
+static void console_disconnect(h2_console_t * const c) {
+	assert(c);
+	pthread_mutex_lock(&c->lock);
+	close(c->input);
+	c->input = -1;
+	c->output = -1;
+	pthread_mutex_unlock(&c->lock);
+	note("console client disconnected from %s", c->path);
+}
+
+static struct timespec console_deadline(const long ns) {
+	struct timespec deadline = { 0, 0 };
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += ns;
+	if (deadline.tv_nsec >= 1000000000l) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000l;
+	}
+	return deadline;
+}
+
+/* Wakeups are sent without holding the lock so the simulation never takes
+ * it, the waits are therefore bounded in case one is missed. */
+static void console_push(h2_console_t * const c, const uint8_t *data, size_t n) {
+	assert(c);
+	while (n && !H2_LOAD_ACQUIRE(&c->stop)) {
+		const size_t pushed = fifo_push_n(c->rx, data, n);
+		data += pushed;
+		n    -= pushed;
+		pthread_cond_signal(&c->readable);
+		if (!n)
+			break;
+		const struct timespec deadline = console_deadline(CONSOLE_IDLE_WAIT_NS);
+		pthread_mutex_lock(&c->lock);
+		if (fifo_is_full(c->rx) && !H2_LOAD_ACQUIRE(&c->stop))
+			pthread_cond_timedwait(&c->writable, &c->lock, &deadline);
+		pthread_mutex_unlock(&c->lock);
+	}
+}
+
+static void *console_reader(void *context) {
+	h2_console_t * const c = context;
+	uint8_t buffer[sizeof(c->stash)];
+	while (!H2_LOAD_ACQUIRE(&c->stop)) {
+		pthread_mutex_lock(&c->lock);
+		const int input = c->input;
+		pthread_mutex_unlock(&c->lock);
+		if (input < 0) {
+			console_accept(c);
+			continue;
+		}
+
+		struct pollfd p = { .fd = input, .events = POLLIN };
+		const int ready = poll(&p, 1, CONSOLE_POLL_MS);
+		if (ready == 0 || (ready < 0 && errno == EINTR))
+			continue;
+		const ssize_t n = ready < 0 ? -1 : read(input, buffer, sizeof(buffer));
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (n <= 0 && c->listener >= 0) {
+			console_disconnect(c);
+			continue;
+		}
+
+		if (n <= 0) {
+			H2_STORE_RELEASE(&c->eof, true);
+			pthread_cond_signal(&c->readable);
+			break;
+		}
+		const uint8_t *escape = c->terminal ? memchr(buffer, ESCAPE, n) : NULL;
+		const size_t length = escape ? (size_t)(escape - buffer) + 1 : (size_t)n;
+		console_push(c, buffer, length);
+		if (escape) {
+			c->stash_length = n - length;
+			memcpy(c->stash, &buffer[length], c->stash_length);
+			H2_STORE_RELEASE(&c->escaped, true);
+			pthread_cond_signal(&c->readable);
+			break;
+		}
+	}
+	if (H2_LOAD_ACQUIRE(&c->escaped))
+		console_cooked(c);
+	return NULL;
+}
+
+/* Only used once the reader thread has handed standard input over to the
+ * debugger, this blocks as the default handlers do. */
+static int console_getch_blocking(h2_console_t * const c, bool *debug_on) {
+	assert(c);
+	if (c->stash_index < c->stash_length)
+		return c->stash[c->stash_index++];
+	bool ignored = false;
+	return wrap_getch(debug_on ? debug_on : &ignored);
+}
+
+static void console_idle(h2_console_t * const c) {
+	assert(c);
+	h2_console_flush(c);
+	if (!c->sleeps || ++c->idle < CONSOLE_IDLE_POLLS)
+		return;
+	c->idle = 0;
+	const struct timespec deadline = console_deadline(CONSOLE_IDLE_WAIT_NS);
+	pthread_mutex_lock(&c->lock);
+	if (fifo_is_empty(c->rx) && !H2_LOAD_ACQUIRE(&c->eof) && !H2_LOAD_ACQUIRE(&c->escaped))
+		pthread_cond_timedwait(&c->readable, &c->lock, &deadline);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static uint16_t console_get(h2_soc_state_t * const soc, const uint16_t addr, bool *debug_on, void *param) {
+	assert(soc);
+	h2_console_t * const c = param;
+	UNUSED(debug_on);
+	/* the flags are set after the final push, so load them first */
+	const bool eof = H2_LOAD_ACQUIRE(&c->eof), escaped = H2_LOAD_ACQUIRE(&c->escaped);
+	const bool empty = fifo_is_empty(c->rx);
+	const bool uart = addr == iUart;
+	const uint16_t getchar_register = uart ? soc->uart_getchar_register : soc->ps2_getchar_register;
+	uint16_t status = UART_TX_FIFO_EMPTY;
+	if (uart && c->paced)
+		status = (c->tx_count ? 0 : UART_TX_FIFO_EMPTY) | (c->tx_count >= UART_FIFO_DEPTH ? UART_TX_FIFO_FULL : 0);
+	if (empty && eof) {
+		h2_console_flush(c);
+		if (!c->exits) { /* the caller may be on another thread to the one owning 'io' */
+			soc->halt = true;
+			return status | UART_RX_FIFO_EMPTY | getchar_register;
+		}
+		note("End Of Input - exiting");
+		exit(EXIT_SUCCESS);
+	}
+	if ((empty && !escaped) || (c->paced && c->cycles < c->rx_next)) {
+		console_idle(c);
+		return status | UART_RX_FIFO_EMPTY | getchar_register;
+	}
+	c->idle = 0;
+	return status | getchar_register;
+}
+
+static void console_set(h2_soc_state_t * const soc, const uint16_t addr, const uint16_t value, bool *debug_on, void *param) {
+	assert(soc);
+	h2_console_t * const c = param;
+	const bool uart = addr == oUart;
+	if (value & UART_TX_WE) {
+		if (!uart) {
+			h2_terminal_put(soc, value);
+		} else if (!c->paced) {
+			console_putc(c, value & 0xFF);
+		} else if (c->tx_count < UART_FIFO_DEPTH) { /* as with the hardware, writes to a full FIFO are lost */
+			if (!c->tx_count)
+				c->tx_next = c->cycles + console_character_cycles(soc->uart_tx_baud);
+			c->tx_count++;
+			console_putc(c, value & 0xFF);
+		}
+	}
+	if (!(value & UART_RX_RE))
+		return;
+	if (c->paced && c->cycles < c->rx_next)
+		return;
+	uint8_t ch = 0;
+	const bool escaped = H2_LOAD_ACQUIRE(&c->escaped);
+	const bool popped = fifo_pop(c->rx, &ch);
+	if (popped)
+		pthread_cond_signal(&c->writable);
+	if (!popped) {
+		if (!escaped)
+			return; /* nothing to read, as with the hardware FIFO */
+		ch = console_getch_blocking(c, debug_on);
+	}
+	if (c->paced)
+		c->rx_next = c->cycles + console_character_cycles(soc->uart_rx_baud);
+	if (ch == ESCAPE && c->terminal) {
+		h2_console_flush(c);
+		if (debug_on)
+			*debug_on = true;
+	}
+	ch = ch == DELETE ? BACKSPACE : ch;
+	if (uart)
+		soc->uart_getchar_register = ch;
+	else
+		soc->ps2_getchar_register  = ch;
+}
+
+static void console_update(h2_soc_state_t * const soc, void *param) {
+	UNUSED(soc);
+	h2_console_flush(param);
+}
+
+static void console_pace(h2_soc_state_t * const soc, void *param) {
+	h2_console_t * const c = param;
+	c->cycles += CONSOLE_PACE_CYCLES;
+	while (c->tx_count && c->cycles >= c->tx_next) {
+		c->tx_count--;
+		c->tx_next += console_character_cycles(soc->uart_tx_baud);
+	}
+}
+
+static h2_console_t *console_new(const int input, const int output, const int listener, const int slave, const char *path) {
+	h2_console_t *c = allocate_or_die(sizeof(*c));
+	c->input    = input;
+	c->output   = output;
+	c->listener = listener;
+	c->slave    = slave;
+	c->path     = path ? duplicate(path) : NULL;
+	c->rx       = fifo_new(UART_FIFO_DEPTH);
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->readable, NULL);
+	pthread_cond_init(&c->writable, NULL);
+
+	if (input >= 0 && isatty(input) && slave < 0 && tcgetattr(input, &c->cooked) == 0) {
+		struct termios raw = c->cooked;
+		raw.c_iflag &= ~(ICRNL);
+		raw.c_lflag &= ~(ICANON | ECHO);
+		c->raw = tcsetattr(input, TCSANOW, &raw) == 0;
+	}
+
+	const int r = pthread_create(&c->reader, NULL, console_reader, c);
+	if (r) {
+		error("could not start console thread: %s", strerror(r));
+		h2_console_free(c);
+		return NULL;
+	}
+	c->running = true;
+	return c;
+}
+
+h2_console_t *h2_console_new(const int input, const int output) {
+	h2_console_t *c = console_new(input, output, -1, -1, NULL);
+	if (c)
+		c->terminal = true;
+	return c;
+}
+
+/* The slave side is put into raw mode so that bytes pass through unaltered,
+ * programs that open it will usually set the mode they want anyway. */
+static h2_console_t *console_pty(const char *link) {
+	errno = 0;
+	const int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+		error("could not create pseudo terminal: %s", reason());
+		if (master >= 0)
+			close(master);
+		return NULL;
+	}
+	const char *name = ptsname(master);
+	const int slave = name ? open(name, O_RDWR | O_NOCTTY) : -1;
+	if (slave < 0) {
+		error("could not open pseudo terminal %s: %s", name ? name : "(unknown)", reason());
+		close(master);
+		return NULL;
+	}
+	struct termios raw;
+	if (tcgetattr(slave, &raw) == 0) {
+		raw.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+		raw.c_oflag &= ~(OPOST);
+		raw.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+		raw.c_cflag &= ~(CSIZE | PARENB);
+		raw.c_cflag |= CS8;
+		tcsetattr(slave, TCSANOW, &raw);
+	}
+	if (link) {
+		unlink(link);
+		if (symlink(name, link) < 0) {
+			error("could not link %s to %s: %s", link, name, reason());
+			close(slave);
+			close(master);
+			return NULL;
+		}
+	}
+	fprintf(stderr, "UART on %s\n", link ? link : name);
+	return console_new(master, master, -1, slave, link);
+}
+
+static h2_console_t *console_socket(const char *path) {
+	assert(path);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		error("socket path too long: %s", path);
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+	errno = 0;
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		error("socket failed: %s", reason());
+		return NULL;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+		error("could not listen on %s: %s", path, reason());
+		close(fd);
+		return NULL;
+	}
+	signal(SIGPIPE, SIG_IGN); /* a departing client must not kill the simulation */
+	fprintf(stderr, "UART on unix:%s\n", path);
+	return console_new(-1, -1, fd, -1, path);
+}
+
+h2_console_t *h2_console_open(const char *name) {
+	static const char pty_prefix[] = "pty:", unix_prefix[] = "unix:";
+	if (!name || !strcmp(name, "stdio"))
+		return h2_console_new(fileno(stdin), fileno(stdout));
+	if (!strcmp(name, "pty"))
+		return console_pty(NULL);
+	if (!strncmp(name, pty_prefix, sizeof(pty_prefix) - 1))
+		return console_pty(name + sizeof(pty_prefix) - 1);
+	if (!strncmp(name, unix_prefix, sizeof(unix_prefix) - 1))
+		return console_socket(name + sizeof(unix_prefix) - 1);
+	error("unknown console '%s', expected 'stdio', 'pty', 'pty:link' or 'unix:path'", name);
+	return NULL;
+}
+
+void h2_console_free(h2_console_t *c) {
+	if (!c)
+		return;
+	if (c->running) {
+		H2_STORE_RELEASE(&c->stop, true);
+		pthread_cond_broadcast(&c->writable);
+		pthread_join(c->reader, NULL);
+	}
+	h2_console_flush(c);
+	console_cooked(c);
+	if (c->listener >= 0) {
+		if (c->input >= 0)
+			close(c->input);
+		close(c->listener);
+	} else if (c->slave >= 0) {
+		close(c->slave);
+		close(c->input);
+	}
+	if (c->path)
+		unlink(c->path);
+	pthread_cond_destroy(&c->writable);
+	pthread_cond_destroy(&c->readable);
+	pthread_mutex_destroy(&c->lock);
+	fifo_free(c->rx);
+	free(c->path);
+	memset(c, 0, sizeof(*c));
+	free(c);
+}
+
+int h2_console_attach(h2_console_t * const c, h2_io_t * const io, const unsigned options) {
+	assert(c);
+	assert(io);
+	const h2_peripheral_t flusher = {
+		.name   = "console",
+		.update = console_update,
+		.param  = c,
+		.period = CONSOLE_FLUSH_CYCLES,
+	};
+	const h2_peripheral_t pacer = {
+		.name   = "console-pacing",
+		.update = console_pace,
+		.param  = c,
+		.period = CONSOLE_PACE_CYCLES,
+	};
+	c->paced = options & H2_CONSOLE_PACED;
+	c->sleeps = !(options & H2_CONSOLE_NO_IDLE);
+	c->exits = !(options & H2_CONSOLE_NO_EXIT);
+	if (options & H2_CONSOLE_UART)
+		if (h2_io_register_input(io, iUart, console_get, c) < 0
+		|| h2_io_register_output(io, oUart, console_set, c) < 0)
+			return -1;
+	if (options & H2_CONSOLE_KEYBOARD)
+		if (h2_io_register_input(io, iVT100, console_get, c) < 0
+		|| h2_io_register_output(io, oVT100, console_set, c) < 0)
+			return -1;
+	if (c->paced && h2_io_register_peripheral(io, &pacer) < 0)
+		return -1;
+	return h2_io_register_peripheral(io, &flusher);
+}
+#else
+h2_console_t *h2_console_new(const int input, const int output) {
+	UNUSED(input);
+	UNUSED(output);
+	warning("non-blocking console not supported on this platform");
+	return NULL;
+}
+
+h2_console_t *h2_console_open(const char *name) {
+	UNUSED(name);
+	warning("non-blocking console not supported on this platform");
+	return NULL;
+}
+
+void h2_console_free(h2_console_t *c) {
+	UNUSED(c);
+}
+
+void h2_console_flush(h2_console_t *c) {
+	UNUSED(c);
+}
+
+int h2_console_attach(h2_console_t *c, h2_io_t *io, const unsigned options) {
+	UNUSED(c);
+	UNUSED(io);
+	UNUSED(options);
+	return -1;
+}
+#endif
+
+/* ========================== Console ====================================== */
+
+/* ========================== Terminal Thread ============================== */
+
+/* Parsing escape sequences and scrolling the screen costs far more than the
+ * rest of a write to 'oVT100', so a thread does it instead. The simulation
+ * pushes each character onto a FIFO, the thread applies whole spans with
+ * 'vt100_write' and only discards them afterwards, so once the FIFO is seen
+ * to be empty the screen is up to date and nothing else touches it until the
+ * simulation writes again. A full FIFO stalls the simulation rather than
+ * losing output. */
+
+#define TERMINAL_QUEUE   (1u << 16)
+#define TERMINAL_WAIT_NS (1000000l) /**< longest wait for output */
+
+#ifdef __unix__
+#include <sched.h>
+
+struct h2_terminal {
+	vt100_t *screen;
+	fifo_t *queue;   /**< simulation produces, terminal thread consumes */
+	pthread_t thread;
+	pthread_mutex_t lock; /**< only needed for the waits */
+	pthread_cond_t ready;
+	bool stop;       /**< atomic, thread should exit once the queue is empty */
+};
+
+static void *terminal_thread(void *context) {
+	struct h2_terminal * const t = context;
+	for (;;) {
+		const fifo_data_t *span = NULL;
+		const size_t n = fifo_peek(t->queue, &span);
+		if (n) {
+			vt100_write(t->screen, span, n);
+			fifo_discard(t->queue, n);
+			continue;
+		}
+		if (H2_LOAD_ACQUIRE(&t->stop) && fifo_is_empty(t->queue))
+			break;
+		const struct timespec deadline = console_deadline(TERMINAL_WAIT_NS);
+		pthread_mutex_lock(&t->lock);
+		if (fifo_is_empty(t->queue) && !H2_LOAD_ACQUIRE(&t->stop))
+			pthread_cond_timedwait(&t->ready, &t->lock, &deadline);
+		pthread_mutex_unlock(&t->lock);
+	}
+	return NULL;
+}
+
+int h2_terminal_start(h2_soc_state_t *soc) {
+	assert(soc);
+	if (soc->terminal)
+		return 0;
+	struct h2_terminal *t = allocate_or_die(sizeof(*t));
+	t->screen = &soc->vt100;
+	t->queue  = fifo_new(TERMINAL_QUEUE);
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->ready, NULL);
+	const int e = pthread_create(&t->thread, NULL, terminal_thread, t);
+	if (e) {
+		error("could not start terminal thread: %s", strerror(e));
+		pthread_cond_destroy(&t->ready);
+		pthread_mutex_destroy(&t->lock);
+		fifo_free(t->queue);
+		free(t);
+		return -1;
+	}
+	soc->terminal = t;
+	return 0;
+}
+
+void h2_terminal_stop(h2_soc_state_t *soc) {
+	assert(soc);
+	struct h2_terminal *t = soc->terminal;
+	if (!t)
+		return;
+	H2_STORE_RELEASE(&t->stop, true);
+	pthread_cond_signal(&t->ready);
+	pthread_join(t->thread, NULL);
+	pthread_cond_destroy(&t->ready);
+	pthread_mutex_destroy(&t->lock);
+	fifo_free(t->queue);
+	free(t);
+	soc->terminal = NULL;
+}
+
+/* The thread is only woken when the queue was empty, as otherwise it is
+ * still busy with earlier output, and the waits are bounded should the
+ * wakeup be missed. */
+void h2_terminal_put(h2_soc_state_t *soc, const uint8_t c) {
+	assert(soc);
+	struct h2_terminal * const t = soc->terminal;
+	if (!t) {
+		vt100_update(&soc->vt100, c);
+		return;
+	}
+	const bool idle = fifo_is_empty(t->queue);
+	while (!fifo_push(t->queue, c)) {
+		pthread_cond_signal(&t->ready);
+		sched_yield();
+	}
+	if (idle)
+		pthread_cond_signal(&t->ready);
+}
+
+void h2_terminal_sync(h2_soc_state_t *soc) {
+	assert(soc);
+	struct h2_terminal * const t = soc->terminal;
+	if (!t)
+		return;
+	if (!fifo_is_empty(t->queue))
+		pthread_cond_signal(&t->ready);
+	while (!fifo_is_empty(t->queue))
+		sched_yield();
+}
+#else
+int h2_terminal_start(h2_soc_state_t *soc) {
+	UNUSED(soc);
+	return -1;
+}
+
+void h2_terminal_stop(h2_soc_state_t *soc) {
+	UNUSED(soc);
+}
+
+void h2_terminal_put(h2_soc_state_t *soc, const uint8_t c) {
+	assert(soc);
+	vt100_update(&soc->vt100, c);
+}
+
+void h2_terminal_sync(h2_soc_state_t *soc) {
+	UNUSED(soc);
+}
+#endif
+
+/* ========================== Terminal Thread ============================== */
+
+/* ========================== Script ======================================= */
+
+/* A script drives the UART in place of a console, for batch runs. Each line
+ * is a command followed by its argument:
+ *
+ *	send TEXT         queue TEXT and a carriage return for the UART
+ *	expect REGEX      wait for REGEX in the UART output
+ *	expect-vga REGEX  wait for REGEX in the output written to the VGA
+ *	timeout CYCLES    cycles 'expect' waits before failing (default 1s)
+ *	run CYCLES        let the simulation run for a while
+ *
+ * Blank lines and lines starting with '#' are ignored, TEXT may contain the
+ * escapes '\r', '\n', '\t', '\e' and '\\'. Output is captured as it is
+ * written along with the cycle it was written at, a match consumes the
+ * output up to its end, and the regular expression is only tried again when
+ * more output has arrived. Lines completed before an attempt that failed are
+ * not searched again, so a match has to start on the last line that was
+ * incomplete or after it. Every wait is reported as a line of TAP, with the
+ * cycles it took, and the script stops at the first one that fails. */
+
+#ifndef NO_MAIN /* only used by the command line simulator */
+#define SCRIPT_TIMEOUT (100000000l) /**< one second at CLOCK_SPEED_HZ */
+#define SCRIPT_CHUNK   (10000l)     /**< cycles between checks for a match */
+#define SCRIPT_CAPTURE (1u << 16)   /**< output kept for matching */
+#define SCRIPT_LINE    (4096u)
+#define SCRIPT_FAILED  (-2)         /**< an 'expect' timed out, as opposed to an error */
+#define SCRIPT_EXIT    (2)          /**< exit status after a failed 'expect' */
+
+#ifdef __unix__
+#include <regex.h>
+
+typedef struct {
+	char data[SCRIPT_CAPTURE + 1]; /* kept terminated for 'regexec' */
+	uint64_t stamps[SCRIPT_CAPTURE]; /* cycle each character was written at */
+	size_t length;
+	size_t searched; /* complete lines before this did not match */
+	bool changed; /* output has arrived since the last attempt to match */
+} script_capture_t;
+
+typedef enum {
+	SCRIPT_IDLE,
+	SCRIPT_EXPECT,
+	SCRIPT_RUN,
+} script_wait_e;
+
+typedef struct {
+	FILE *input, *results;
+	const h2_t *h;
+	char name[SCRIPT_LINE]; /* of the current step, for reporting */
+	unsigned line, steps;
+	script_wait_e wait;
+	script_capture_t *expecting;
+	regex_t regex;
+	uint64_t start, timeout, duration;
+	uint8_t send[SCRIPT_LINE * 4];
+	size_t send_length, send_index;
+	script_capture_t uart, vga;
+} script_t;
+
+static void script_append(script_t *s, script_capture_t *c, const uint8_t ch) {
+	assert(s);
+	assert(c);
+	if (!ch) /* would terminate the string given to 'regexec' */
+		return;
+	if (c->length == SCRIPT_CAPTURE) { /* forget the oldest half */
+		const size_t half = SCRIPT_CAPTURE / 2;
+		memmove(c->data, &c->data[half], half);
+		memmove(c->stamps, &c->stamps[half], half * sizeof(c->stamps[0]));
+		c->length = half;
+		c->searched = c->searched > half ? c->searched - half : 0;
+	}
+	c->stamps[c->length] = s->h->stats.cycles;
+	c->data[c->length++] = ch;
+	c->data[c->length] = '\0';
+	c->changed = true;
+}
+
+static void script_consume(script_capture_t *c, const size_t n) {
+	assert(c);
+	assert(n <= c->length);
+	memmove(c->data, &c->data[n], c->length - n);
+	memmove(c->stamps, &c->stamps[n], (c->length - n) * sizeof(c->stamps[0]));
+	c->length -= n;
+	c->data[c->length] = '\0';
+	c->searched = 0;
+}
+
+/* Each check only searches from the start of the line that was incomplete
+ * last time, rather than all of the output captured, which can be large. */
+static bool script_match(script_t *s, script_capture_t *c, size_t *end) {
+	assert(s);
+	assert(c);
+	assert(end);
+	regmatch_t m[1];
+	if (!c->changed)
+		return false;
+	c->changed = false;
+	if (regexec(&s->regex, &c->data[c->searched], 1, m, 0) == 0) {
+		*end = c->searched + m[0].rm_eo;
+		return true;
+	}
+	for (size_t i = c->length; i > c->searched; i--)
+		if (c->data[i - 1] == '\n') {
+			c->searched = i;
+			break;
+		}
+	return false;
+}
+
+static uint16_t script_get(h2_soc_state_t * const soc, const uint16_t addr, bool *debug_on, void *param) {
+	assert(soc);
+	script_t * const s = param;
+	UNUSED(debug_on);
+	if (addr != iUart) /* the keyboard is never pressed */
+		return UART_TX_FIFO_EMPTY | UART_RX_FIFO_EMPTY | soc->ps2_getchar_register;
+	const bool empty = s->send_index >= s->send_length;
+	return UART_TX_FIFO_EMPTY | (empty ? UART_RX_FIFO_EMPTY : 0) | soc->uart_getchar_register;
+}
+
+static void script_set(h2_soc_state_t * const soc, const uint16_t addr, const uint16_t value, bool *debug_on, void *param) {
+	assert(soc);
+	script_t * const s = param;
+	UNUSED(debug_on);
+	const bool uart = addr == oUart;
+	if (value & UART_TX_WE) {
+		if (!uart)
+			h2_terminal_put(soc, value);
+		script_append(s, uart ? &s->uart : &s->vga, value & 0xFF);
+	}
+	if ((value & UART_RX_RE) && uart && s->send_index < s->send_length)
+		soc->uart_getchar_register = s->send[s->send_index++];
+}
+
+static size_t script_unescape(uint8_t *out, const char *in) {
+	assert(out);
+	assert(in);
+	size_t n = 0;
+	for (; *in; in++) {
+		if (*in != '\\' || !in[1]) {
+			out[n++] = *in;
+			continue;
+		}
+		switch (*++in) {
+		case 'r': out[n++] = '\r';   break;
+		case 'n': out[n++] = '\n';   break;
+		case 't': out[n++] = '\t';   break;
+		case 'e': out[n++] = ESCAPE; break;
+		default:  out[n++] = *in;    break;
+		}
+	}
+	return n;
+}
+
+/* diagnostics are the unmatched output, one TAP comment per line */
+static void script_diagnose(script_t *s, const script_capture_t *c) {
+	assert(s);
+	assert(c);
+	fputs("# ", s->results);
+	for (size_t i = 0; i < c->length; i++) {
+		const int ch = c->data[i];
+		if (ch == '\n')
+			fputs("\n# ", s->results);
+		else if (ch != '\r')
+			fputc(isprint(ch) ? ch : '?', s->results);
+	}
+	fputc('\n', s->results);
+}
+
+static void script_free(script_t *s) {
+	if (!s)
+		return;
+	if (s->wait == SCRIPT_EXPECT)
+		regfree(&s->regex);
+	if (s->input)
+		fclose(s->input);
+	free(s);
+}
+
+static script_t *script_open(const char *file, const h2_t *h, h2_io_t *io, FILE *results) {
+	assert(file);
+	assert(h);
+	assert(io);
+	assert(results);
+	script_t *s = allocate_or_die(sizeof(*s));
+	s->h       = h;
+	s->results = results;
+	s->timeout = SCRIPT_TIMEOUT;
+	errno = 0;
+	if (!(s->input = fopen(file, "rb"))) {
+		error("could not open script %s: %s", file, reason());
+		goto fail;
+	}
+	if (h2_io_register_input(io, iUart, script_get, s) < 0
+	|| h2_io_register_input(io, iVT100, script_get, s) < 0
+	|| h2_io_register_output(io, oUart, script_set, s) < 0
+	|| h2_io_register_output(io, oVT100, script_set, s) < 0)
+		goto fail;
+	return s;
+fail:
+	script_free(s);
+	return NULL;
+}
+
+/* returns negative if a step failed, zero if the script is waiting and
+ * positive once it has finished */
+static int script_step(script_t *s) {
+	assert(s);
+	const uint64_t now = s->h->stats.cycles;
+	for (;;) {
+		if (s->wait == SCRIPT_RUN) {
+			if (now - s->start < s->duration)
+				return 0;
+			s->wait = SCRIPT_IDLE;
+			fprintf(s->results, "ok %u - %s # %"PRIu64" cycles\n", ++s->steps, s->name, now - s->start);
+			fflush(s->results);
+		}
+		if (s->wait == SCRIPT_EXPECT) {
+			script_capture_t * const c = s->expecting;
+			size_t end = 0;
+			if (script_match(s, c, &end)) {
+				const uint64_t at = end ? c->stamps[end - 1] : now;
+				const uint64_t took = at > s->start ? at - s->start : 0; /* may match earlier output */
+				fprintf(s->results, "ok %u - %s # %"PRIu64" cycles\n", ++s->steps, s->name, took);
+				fflush(s->results);
+				script_consume(c, end);
+				regfree(&s->regex);
+				s->wait = SCRIPT_IDLE;
+			} else if (now - s->start >= s->timeout) {
+				fprintf(s->results, "not ok %u - %s # timed out after %"PRIu64" cycles\n", ++s->steps, s->name, now - s->start);
+				script_diagnose(s, c);
+				fprintf(s->results, "1..%u\n", s->steps);
+				fflush(s->results);
+				return SCRIPT_FAILED;
+			} else {
+				return 0;
+			}
+		}
+
+		char line[SCRIPT_LINE] = { 0 };
+		if (!fgets(line, sizeof(line), s->input)) {
+			fprintf(s->results, "1..%u\n", s->steps);
+			fflush(s->results);
+			return 1;
+		}
+		s->line++;
+		line[strcspn(line, "\r\n")] = '\0';
+		char *command = line + strspn(line, " \t");
+		if (!*command || *command == '#')
+			continue;
+		char *argument = command + strcspn(command, " \t");
+		if (*argument)
+			*argument++ = '\0';
+		snprintf(s->name, sizeof(s->name), "%s %s", command, argument);
+
+		if (!strcmp(command, "send")) {
+			if (s->send_index == s->send_length)
+				s->send_index = s->send_length = 0;
+			if (s->send_length + strlen(argument) + 1 >= sizeof(s->send)) {
+				error("script line %u: too much input queued", s->line);
+				return -1;
+			}
+			s->send_length += script_unescape(&s->send[s->send_length], argument);
+			s->send[s->send_length++] = '\r';
+		} else if (!strcmp(command, "expect") || !strcmp(command, "expect-vga")) {
+			const int e = regcomp(&s->regex, argument, REG_EXTENDED | REG_NEWLINE);
+			if (e) {
+				char message[256] = { 0 };
+				regerror(e, &s->regex, message, sizeof(message));
+				error("script line %u: invalid regular expression '%s': %s", s->line, argument, message);
+				return -1;
+			}
+			s->expecting = command[6] ? &s->vga : &s->uart;
+			s->expecting->changed  = true;
+			s->expecting->searched = 0;
+			s->start = now;
+			s->wait  = SCRIPT_EXPECT;
+		} else if (!strcmp(command, "timeout") || !strcmp(command, "run")) {
+			long cycles = 0;
+			if (string_to_long(0, &cycles, argument) || cycles <= 0) {
+				error("script line %u: invalid number of cycles '%s'", s->line, argument);
+				return -1;
+			}
+			if (command[0] == 't') {
+				s->timeout = cycles;
+				continue;
+			}
+			s->start    = now;
+			s->duration = cycles;
+			s->wait     = SCRIPT_RUN;
+			return 0;
+		} else {
+			error("script line %u: unknown command '%s'", s->line, command);
+			return -1;
+		}
+	}
+}
+#else
+typedef struct script script_t;
+
+static script_t *script_open(const char *file, const h2_t *h, h2_io_t *io, FILE *results) {
+	UNUSED(h);
+	UNUSED(io);
+	UNUSED(results);
+	error("scripts are not supported on this platform: %s", file);
+	return NULL;
+}
+
+static int script_step(script_t *s) {
+	UNUSED(s);
+	return -1;
+}
+
+static void script_free(script_t *s) {
+	UNUSED(s);
+}
+#endif
+#endif
+
+/* ========================== Script ======================================= */
+
+/* ========================== Main ========================================= */
+
+#ifndef NO_MAIN
+typedef enum {
+	DEFAULT_COMMAND,
+	DISASSEMBLE_COMMAND,
+	RUN_COMMAND,
+} command_e;
+
+typedef struct {
+	command_e cmd;
+	long steps;
+	bool full_disassembly;
+	bool debug_mode;
+	bool hacks;
+	disassemble_color_method_e dcm;
+	const char *nvram;
+	const char *stats;     /**< print statistics at exit, "text" or "json" */
+	long metrics_interval; /**< cycles between metrics records, 0 = off */
+	const char *metrics;   /**< metrics file, or "unix:path" for a socket */
+	long publish_interval; /**< cycles between shared memory updates, 0 = off */
+	const char *publish;   /**< shared memory name, NULL = H2_SHM_PREFIX + pid */
+	const char *plugins[H2_PLUGINS_MAX]; /**< peripheral plugins, "file.so[,arguments]" */
+	size_t plugin_count;
+	bool blocking;         /**< block the simulation on input, for repeatable runs */
+	const char *uart;      /**< console for the UART, NULL = standard input/output */
+	bool paced;            /**< UART runs at the programmed baud rate */
+	double pace;           /**< emulated seconds per wall clock second, 0 = flat out */
+	long screenshot_interval; /**< cycles between screenshots, 0 = off */
+	const char *screenshot;   /**< file name pattern for screenshots, 'out%05d.ppm' */
+	const char *script;       /**< drives the UART instead of a console, see 'script_step' */
+	const char *profile;      /**< execution counts by address written here at exit */
+} command_args_t;
+
+typedef struct {
+	const char *name;
+	int option;
+} long_option_t;
+
+/* Long options are aliases for single character options */
+static const long_option_t long_options[] = {
+	{ .name = "help",             .option = 'h' },
+	{ .name = "stats",            .option = 'p' },
+	{ .name = "metrics-interval", .option = 'm' },
+	{ .name = "metrics-file",     .option = 'M' },
+	{ .name = "trace",            .option = 't' },
+	{ .name = "publish",          .option = 'P' },
+	{ .name = "publish-name",     .option = 'N' },
+	{ .name = "plugin",           .option = 'l' },
+	{ .name = "blocking",         .option = 'B' },
+	{ .name = "uart",             .option = 'u' },
+	{ .name = "uart-paced",       .option = 'b' },
+	{ .name = "pace",             .option = 'w' },
+	{ .name = "screenshot-every", .option = 'G' },
+	{ .name = "script",           .option = 'x' },
+	{ .name = "profile",          .option = 'f' },
+	{ .name = NULL,               .option = 0   },
+};
+
+static const char *help = "\
+usage ./h2 [-hvdDarRTHBb] [-sc number] [-w ratio] [-G cycles pattern] [-x script] [-f profile] [-L symbol.file] [-S symbol.file] [-e file.fth] (file.hex|file.fth)\n\n\
+Brief:     A H2 CPU Assembler, disassembler and Simulator.\n\
+Author:    Richard James Howe\n\
+Site:      https://github.com/howerj/forth-cpu\n\
+License:   MIT\n\
+Copyright: Richard James Howe (2017,2018)\n\
+Options:\n\n\
+\t-\tstop processing options, following arguments are files\n\
+\t-h\tprint this help message and exit\n\
+\t-v\tincrease logging level\n\
+\t-d\tdisassemble input files (default)\n\
+\t-D\tfull disassembly of input files\n\
+\t-T\tEnter debug mode when running simulation\n\
+\t-H\tenable hacks to make the simulation easier to use\n\
+\t-r\trun hex file\n\
+\t-L #\tload symbol file\n\
+\t-S #\tsave symbols to file\n\
+\t-s #\tnumber of steps to run simulation (0 = forever)\n\
+\t-n #\tspecify nvram file\n\
+\t-H #\tenable certain hacks for simulation purposes\n\
+\t-c #\tset colorization method for disassembly\n\
+\t-p #\tprint run statistics at exit, # is 'text' or 'json'\n\
+\t-m #\tappend metrics every # cycles (JSON, one record per line)\n\
+\t-M #\tmetrics file (default stderr), 'unix:path' for a socket\n\
+\t-t #\tenable comma separated tracepoints by name, or 'all'\n\
+\t-P #\tpublish state to shared memory every # cycles, see 'h2top'\n\
+\t-N #\tshared memory name (default /h2-<pid>)\n\
+\t-l #\tload peripheral plugin, 'file.so' or 'file.so,arguments'\n\
+\t-B\tblock the simulation when waiting for input, as older versions did\n\
+\t-u #\tUART console, 'stdio', 'pty', 'pty:link' or 'unix:path'\n\
+\t-b\tpace the UART at the baud rate set by the program\n\
+\t-w #\trun at # times real time against the wall clock, 1 = 100MHz\n\
+\t-G # #\tsave the VGA screen every # cycles as PPM, named 'out%05d.ppm'\n\
+\t-x #\trun a script of 'send', 'expect' and 'run' steps, results as TAP\n\
+\t-f #\twrite execution counts by address to file # at exit, see 'h2opt'\n\
+\tfile\thex or forth file to process\n\n\
+Long options: --help (-h), --stats (-p), --metrics-interval (-m),\n\
+--metrics-file (-M), --trace (-t), --publish (-P),\n\
+--publish-name (-N), --plugin (-l), --blocking (-B), --uart (-u),\n\
+--uart-paced (-b), --pace (-w), --screenshot-every (-G),\n\
+--script (-x), --profile (-f).\n\n\
+Options must precede any files given, if a file has not been\n\
+given as arguments input is taken from stdin. Output is to\n\
+stdout. Program returns zero on success, non zero on failure.\n\n\
+";
+
+static void debug_note(const command_args_t * const cmd) {
+	assert(cmd);
+	if (cmd->debug_mode)
+		note("entering debug mode");
+	else
+		note("running for %u cycles (0 = forever)", (unsigned)cmd->steps);
+}
+
+#ifdef __unix__
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static FILE *metrics_socket(const char *path) {
+	assert(path);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		error("unix socket path too long: %s", path);
+		return NULL;
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	errno = 0;
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		error("could not connect to unix socket %s: %s", path, reason());
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	signal(SIGPIPE, SIG_IGN); /* a departing reader must not kill the simulation */
+	FILE *r = fdopen(fd, "wb");
+	if (!r)
+		close(fd);
+	return r;
+}
+#else
+static FILE *metrics_socket(const char *path) {
+	error("unix sockets are not supported on this platform: %s", path);
+	return NULL;
+}
+#endif
+
+static FILE *metrics_open(const char *name) {
+	static const char unix_prefix[] = "unix:";
+	if (!name)
+		return stderr;
+	if (!strncmp(name, unix_prefix, sizeof(unix_prefix) - 1))
+		return metrics_socket(name + sizeof(unix_prefix) - 1);
+	errno = 0;
+	FILE *r = fopen(name, "ab");
+	if (!r)
+		error("could not open metrics file %s: %s", name, reason());
+	return r;
+}
+
+/* The session has to be available from 'atexit', as the simulation is
+ * terminated with 'exit' when the end of input is reached. */
+static struct {
+	const command_args_t *cmd;
+	h2_t *h;
+	h2_io_t *io;
+	FILE *metrics;
+	h2_shm_t *shm;
+	h2_console_t *console;
+	h2_pace_t pace;
+	h2_framebuffer_t *framebuffer;
+	unsigned frame;
+	script_t *script;
+	double start;
+} session;
+
+static volatile sig_atomic_t session_signal = 0; /**< signal that stopped the simulation, if any */
+
+/* The console may have put the terminal in raw mode and a shared memory
+ * segment may be published, 'session_finish' undoes both. That is not safe
+ * to do from within a signal handler, so the simulation is asked to halt
+ * instead and 'run_command' exits once it has cleaned up. A second signal is
+ * not caught, in case the simulation never halts. */
+static void session_interrupt(const int sig) {
+	session_signal = sig;
+	if (session.io)
+		session.io->soc->halt = true;
+	signal(sig, SIG_DFL);
+}
+
+static void session_finish(void) {
+	if (!session.h)
+		return;
+	const double seconds = wall_clock_seconds() - session.start;
+	if (session.metrics) {
+		h2_stats_print(session.metrics, session.h, session.io, seconds, true);
+		if (session.metrics != stderr)
+			fclose(session.metrics);
+	}
+	if (session.shm) {
+		h2_shm_publish(session.shm, session.h, session.io, seconds, true);
+		h2_shm_free(session.shm);
+	}
+	h2_console_free(session.console);
+	h2_framebuffer_free(session.framebuffer);
+	script_free(session.script);
+	if (session.cmd->pace > 0. && session.pace.drift > 0.)
+		warning("simulation fell %.3f seconds behind the wall clock", session.pace.drift);
+	if (session.cmd->stats)
+		h2_stats_print(stderr, session.h, session.io, seconds, !strcmp(session.cmd->stats, "json"));
+	if (session.cmd->profile) { /* 'fatal' cannot be used, this runs from 'atexit' */
+		errno = 0;
+		FILE *profile = fopen(session.cmd->profile, "wb");
+		if (profile) {
+			const int r = h2_profile_print(profile, session.h);
+			if (fclose(profile) < 0 || r < 0)
+				error("could not write profile %s", session.cmd->profile);
+		} else {
+			error("could not open profile %s: %s", session.cmd->profile, reason());
+		}
+	}
+	memset(&session, 0, sizeof(session));
+}
+
+static void session_start(const command_args_t * const cmd, h2_t * const h, h2_io_t * const io) {
+	static bool registered = false;
+	assert(cmd);
+	session.cmd   = cmd;
+	session.h     = h;
+	session.io    = io;
+	session.start = wall_clock_seconds();
+	if (cmd->metrics_interval)
+		session.metrics = metrics_open(cmd->metrics);
+	if (cmd->publish_interval)
+		session.shm = h2_shm_new(cmd->publish);
+	if (cmd->script && !(session.script = script_open(cmd->script, h, io, stdout)))
+		fatal("could not run script %s", cmd->script);
+	if (!cmd->script && (cmd->uart || (!cmd->debug_mode && !cmd->blocking))) { /* the debugger reads standard input */
+		const unsigned options = H2_CONSOLE_UART | H2_CONSOLE_KEYBOARD
+			| (cmd->paced ? H2_CONSOLE_PACED : 0) | (cmd->pace > 0. ? H2_CONSOLE_NO_IDLE : 0);
+		session.console = h2_console_open(cmd->uart);
+		if (!session.console && cmd->uart)
+			fatal("could not open console: %s", cmd->uart);
+		if (session.console && h2_console_attach(session.console, io, options) < 0)
+			fatal("could not attach console");
+	}
+	if (h2_terminal_start(io->soc) < 0)
+		warning("could not start terminal thread, the VT100 is updated by the simulation");
+	if (cmd->pace > 0.)
+		h2_pace_start(&session.pace, cmd->pace, h->stats.cycles);
+	if (cmd->screenshot_interval && !(session.framebuffer = h2_framebuffer_new(VGA_FONT_FILE)))
+		fatal("could not load font %s for screenshots: %s", VGA_FONT_FILE, errno ? reason() : "invalid format");
+	if (cmd->profile && !h->profile)
+		h->profile = allocate_or_die(MAX_CORE * sizeof(h->profile[0]));
+	if (!registered && atexit(session_finish) == 0)
+		registered = true;
+#ifdef __unix__
+	struct sigaction interrupt;
+	memset(&interrupt, 0, sizeof(interrupt));
+	interrupt.sa_handler = session_interrupt; /* without SA_RESTART, so the debugger's read is interrupted */
+	sigemptyset(&interrupt.sa_mask);
+	const int signals[] = { SIGINT, SIGTERM, SIGHUP };
+	for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+		sigaction(signals[i], &interrupt, NULL);
+#else
+	signal(SIGINT,  session_interrupt);
+	signal(SIGTERM, session_interrupt);
+#endif
+}
+
+static int periodic_metrics(void) {
+	if (!session.metrics)
+		return 0;
+	return h2_stats_print(session.metrics, session.h, session.io, wall_clock_seconds() - session.start, true);
+}
+
+static int periodic_publish(void) {
+	h2_shm_publish(session.shm, session.h, session.io, wall_clock_seconds() - session.start, false);
+	return 0;
+}
+
+/* Pacing replaces the console's own idle sleep, which would otherwise stall
+ * a program that polls for input and make it run slower than real time. */
+static int periodic_pace(void) {
+	h2_pace(&session.pace, session.h->stats.cycles);
+	return 0;
+}
+
+static int periodic_screenshot(void) {
+	char name[FILENAME_MAX] = { 0 };
+	h2_terminal_sync(session.io->soc);
+	h2_framebuffer_render(session.framebuffer, &session.io->soc->vt100, false, NULL, NULL);
+	snprintf(name, sizeof(name), session.cmd->screenshot, session.frame++);
+	errno = 0;
+	FILE *out = fopen(name, "wb");
+	if (!out) {
+		error("could not open %s for writing: %s", name, reason());
+		return -1;
+	}
+	const int r = h2_framebuffer_save(session.framebuffer, out);
+	if (fclose(out) < 0 || r < 0) {
+		error("could not write screenshot %s", name);
+		return -1;
+	}
+	return 0;
+}
+
+static int periodic_script(void) {
+	return script_step(session.script);
+}
+
+typedef struct {
+	long interval; /**< cycles between calls to 'action', 0 = disabled */
+	int (*action)(void); /**< negative on failure, positive stops the simulation */
+} periodic_t;
+
+/* The simulation is run in chunks so that actions which must happen every so
+ * many cycles cost nothing within the main loop of 'h2_run'. */
+static int run_simulation(const command_args_t * const cmd, FILE *output, symbol_table_t *symbols) {
+	assert(cmd);
+	const periodic_t periodic[] = {
+		{ .interval = session.metrics ? cmd->metrics_interval : 0, .action = periodic_metrics },
+		{ .interval = session.shm     ? cmd->publish_interval : 0, .action = periodic_publish },
+		{ .interval = cmd->pace > 0.  ? (long)(H2_PACE_BATCH * CLOCK_SPEED_HZ) : 0, .action = periodic_pace },
+		{ .interval = session.framebuffer ? cmd->screenshot_interval : 0, .action = periodic_screenshot },
+		{ .interval = session.script  ? SCRIPT_CHUNK : 0, .action = periodic_script },
+	};
+	const size_t count = sizeof(periodic) / sizeof(periodic[0]);
+	long scheduled = 0;
+	for (size_t i = 0; i < count; i++)
+		scheduled |= periodic[i].interval;
+
+	if (!scheduled || cmd->debug_mode)
+		return h2_run(session.h, session.io, output, cmd->steps, symbols, cmd->debug_mode, NULL);
+
+	for (long done = 0; !cmd->steps || done < cmd->steps;) {
+		long chunk = cmd->steps ? cmd->steps - done : LONG_MAX;
+		for (size_t i = 0; i < count; i++)
+			if (periodic[i].interval)
+				chunk = MIN(chunk, periodic[i].interval - (done % periodic[i].interval));
+		const int r = h2_run(session.h, session.io, output, chunk, symbols, false, NULL);
+		done += chunk;
+		for (size_t i = 0; i < count; i++)
+			if (periodic[i].interval && (done % periodic[i].interval) == 0) {
+				const int a = periodic[i].action();
+				if (a)
+					return a < 0 ? a : 0;
+			}
+		if (r)
+			return r;
+	}
+	return 0;
+}
+
+static int run_command(const command_args_t * const cmd, FILE *input, FILE *output, symbol_table_t *symbols, uint16_t *vga_initial_contents) {
+	assert(input);
+	assert(output);
+	assert(cmd);
+	assert(cmd->nvram);
+	int r = 0;
+
+	h2_t *h = h2_new(START_ADDR);
+	if (h2_load(h, input) < 0)
+		return -1;
+
+	if (!h)
+		return -1;
+
+	h2_io_t * const io = h2_io_new();
+	assert(VGA_BUFFER_LENGTH <= VT100_MAX_SIZE);
+	for (size_t i = 0; i < VGA_BUFFER_LENGTH; i++) /* same cell layout as the hardware */
+		io->soc->vt100.cells[i] = vga_initial_contents[i];
+
+	for (size_t i = 0; i < cmd->plugin_count; i++)
+		if (h2_io_plugin_load(io, cmd->plugins[i]) < 0)
+			fatal("could not load plugin: %s", cmd->plugins[i]);
+
+	nvram_load_and_transfer(io, cmd->nvram, cmd->hacks);
+	h->pc = START_ADDR;
+	if (cmd->script && cmd->debug_mode)
+		fatal("a script cannot be run in debug mode");
+	debug_note(cmd);
+	session_start(cmd, h, io);
+	r = run_simulation(cmd, output, symbols);
+	session_finish();
+	nvram_save(io, cmd->nvram);
+
+	h2_free(h);
+	h2_io_free(io);
+	if (session_signal)
+		exit(128 + session_signal); /* as a shell reports a process killed by a signal */
+	if (r == SCRIPT_FAILED) {
+		error("script %s failed, see its results", cmd->script);
+		exit(SCRIPT_EXIT);
+	}
+	return r;
+}
+
+int command(const command_args_t * const cmd, FILE *input, FILE *output, symbol_table_t *symbols, uint16_t *vga_initial_contents) {
+	assert(input);
+	assert(output);
+	assert(cmd);
+	assert(vga_initial_contents);
+	switch (cmd->cmd) {
+	case DEFAULT_COMMAND:      /* fall through */
+	case DISASSEMBLE_COMMAND:  return h2_disassemble(cmd->dcm, input, output, symbols);
+	case RUN_COMMAND:          return run_command(cmd, input, output, symbols, vga_initial_contents);
+	default:                   fatal("invalid command: %d", cmd->cmd);
+	}
+	return -1;
+}
+
+static const char *nvram_file = FLASH_INIT_FILE;
+
+/* a file name pattern is used as a format string, it may contain only a
+ * single conversion for the frame number, such as "%u" or "%05d" */
+static bool frame_pattern_valid(const char *pattern) {
+	assert(pattern);
+	unsigned conversions = 0;
+	for (const char *s = pattern; *s; s++) {
+		if (*s != '%')
+			continue;
+		if (*++s == '%')
+			continue;
+		s += strspn(s, "0123456789");
+		if (*s != 'u' && *s != 'd')
+			return false;
+		conversions++;
+	}
+	return conversions == 1;
+}
+
+int h2_main(int argc, char **argv) {
+	int i;
+	const char *optarg = NULL;
+	command_args_t cmd;
+	symbol_table_t *symbols = NULL;
+	FILE *symfile = NULL;
+	FILE *input = NULL;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.steps = DEFAULT_STEPS;
+	cmd.nvram = nvram_file;
+	cmd.dcm   = DCM_X11;
+
+	static uint16_t vga_initial_contents[VGA_BUFFER_LENGTH] = { 0 };
+
+	binary(stdin);
+	binary(stdout);
+	binary(stderr);
+
+	{ /* attempt to load initial contents of VGA memory */
+		errno = 0;
+		FILE *vga_init = fopen(VGA_INIT_FILE, "rb");
+		if (vga_init) {
+			memory_load(vga_init, vga_initial_contents, VGA_BUFFER_LENGTH);
+			fclose(vga_init);
+		} else {
+			warning("could not load initial VGA memory file %s: %s", VGA_INIT_FILE, strerror(errno));
+		}
+	}
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		int option = argv[i][1];
+
+		if (option == '-' && argv[i][2]) {
+			size_t j = 0;
+			for (j = 0; long_options[j].name && strcmp(long_options[j].name, &argv[i][2]); j++)
+				/*do nothing*/;
+			if (!long_options[j].name)
+				goto fail;
+			option = long_options[j].option;
+		} else if (strlen(argv[i]) > 2) {
+			error("Only one option allowed at a time (got %s)", argv[i]);
+			goto fail;
+		}
+
+		switch (option) {
+		case '\0':
+			goto done; /* stop processing options */
+		case 'h':
+			fprintf(stderr, "%s\n", help);
+			return -1;
+		case 'v':  /* increase verbosity */
+			log_level += log_level < LOG_ALL_MESSAGES ? 1 : 0;
+			break;
+		case 'D':
 			cmd.full_disassembly = true;
 			/* fall through */
 		case 'd':
@@ -2579,6 +4832,91 @@ int h2_main(int argc, char **argv) {
 		case 'H':
 			cmd.hacks = true;
 			break;
+		case 'p':
+			if (i >= (argc - 1))
+				goto fail;
+			cmd.stats = argv[++i];
+			if (strcmp(cmd.stats, "text") && strcmp(cmd.stats, "json"))
+				goto fail;
+			break;
+		case 'm':
+			if (i >= (argc - 1))
+				goto fail;
+			optarg = argv[++i];
+			if (string_to_long(0, &cmd.metrics_interval, optarg) || cmd.metrics_interval < 0)
+				goto fail;
+			break;
+		case 'M':
+			if (i >= (argc - 1))
+				goto fail;
+			cmd.metrics = argv[++i];
+			break;
+		case 'P':
+			if (i >= (argc - 1))
+				goto fail;
+			optarg = argv[++i];
+			if (string_to_long(0, &cmd.publish_interval, optarg) || cmd.publish_interval < 0)
+				goto fail;
+			break;
+		case 'N':
+			if (i >= (argc - 1))
+				goto fail;
+			cmd.publish = argv[++i];
+			break;
+		case 'B':
+			cmd.blocking = true;
+			break;
+		case 'b':
+			cmd.paced = true;
+			break;
+		case 'u':
+			if (i >= (argc - 1))
+				goto fail;
+			cmd.uart = argv[++i];
+			break;
+		case 'G':
+			if (i >= (argc - 2))
+				goto fail;
+			optarg = argv[++i];
+			if (string_to_long(0, &cmd.screenshot_interval, optarg) || cmd.screenshot_interval <= 0)
+				goto fail;
+			cmd.screenshot = argv[++i];
+			if (!frame_pattern_valid(cmd.screenshot))
+				goto fail;
+			break;
+		case 'x':
+			if (i >= (argc - 1))
+				goto fail;
+			cmd.script = argv[++i];
+			break;
+		case 'f':
+			if (i >= (argc - 1))
+				goto fail;
+			cmd.profile = argv[++i];
+			break;
+		case 'w':
+		{
+			if (i >= (argc - 1))
+				goto fail;
+			optarg = argv[++i];
+			char *end = NULL;
+			errno = 0;
+			cmd.pace = strtod(optarg, &end);
+			if (errno || *end || !(cmd.pace > 0.))
+				goto fail;
+			break;
+		}
+		case 'l':
+			if (i >= (argc - 1) || cmd.plugin_count >= H2_PLUGINS_MAX)
+				goto fail;
+			cmd.plugins[cmd.plugin_count++] = argv[++i];
+			break;
+		case 't':
+			if (i >= (argc - 1))
+				goto fail;
+			if (tracepoint_enable(argv[++i], true) < 0)
+				warning("could not enable all tracepoints in '%s'", argv[i]);
+			break;
 		default:
 		fail:
 			fatal("invalid argument '%s'\n%s\n", argv[i], help);
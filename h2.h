@@ -27,6 +27,40 @@
 #define VGA_INIT_FILE        ("text.hex")  /**< default name for VGA screen */
 #define FLASH_INIT_FILE      ("nvram.blk") /**< default file for flash initialization */
 
+#define NUMBER_OF_INTERRUPTS (8u)
+#define H2_IO_REGISTERS      (32u) /**< I/O registers are word addresses $4000-$403E */
+#define H2_IO_INDEX(ADDR)    (((ADDR) >> 1) & (H2_IO_REGISTERS - 1))
+#define H2_IO_BASE           (0x4000u)
+#define H2_IO_VALID(ADDR)    (((ADDR) & ~((H2_IO_REGISTERS - 1) << 1)) == H2_IO_BASE)
+#define H2_IO_SLOT(ADDR)     (H2_IO_VALID(ADDR) ? H2_IO_INDEX(ADDR) : H2_IO_REGISTERS) /**< last slot catches invalid addresses */
+
+#define X_MACRO_INSTRUCTION_CLASSES\
+	X(INSTRUCTION_CLASS_LITERAL, "literal")\
+	X(INSTRUCTION_CLASS_ALU,     "alu")\
+	X(INSTRUCTION_CLASS_CALL,    "call")\
+	X(INSTRUCTION_CLASS_0BRANCH, "0branch")\
+	X(INSTRUCTION_CLASS_BRANCH,  "branch")
+
+typedef enum {
+#define X(ENUM, NAME) ENUM,
+	X_MACRO_INSTRUCTION_CLASSES
+#undef X
+	INSTRUCTION_CLASS_MAX
+} h2_instruction_class_e;
+
+typedef struct {
+	uint64_t cycles;     /**< total cycles simulated, including wait states */
+	uint64_t waits;      /**< cycles the core spent halted on 'soc->wait' */
+	uint64_t instructions[INSTRUCTION_CLASS_MAX];
+	uint64_t io_reads[H2_IO_REGISTERS + 1];  /**< indexed by H2_IO_SLOT */
+	uint64_t io_writes[H2_IO_REGISTERS + 1]; /**< indexed by H2_IO_SLOT */
+	uint64_t interrupts[NUMBER_OF_INTERRUPTS];
+	uint64_t interrupt_latency[NUMBER_OF_INTERRUPTS];     /**< summed cycles from request to service */
+	uint64_t interrupt_latency_max[NUMBER_OF_INTERRUPTS];
+	uint64_t interrupt_raised;  /**< cycle the pending interrupt was raised on */
+	bool interrupt_pending;
+} h2_stats_t; /**< statistics gathered by h2_run, see h2_stats_print */
+
 typedef struct {
 	size_t length;
 	uint16_t *points;
@@ -46,6 +80,8 @@ typedef struct {
 	break_point_t bp; /**< list of break points */
 	uint16_t rpm; /**< maximum value of rp ever encountered */
 	uint16_t spm; /**< maximum value of sp ever encountered */
+	h2_stats_t stats; /**< run statistics */
+	uint64_t *profile; /**< MAX_CORE execution counts by address, NULL if not profiling */
 } h2_t; /**< state of the H2 CPU */
 
 typedef enum {
@@ -155,6 +191,8 @@ typedef struct {
 	uint16_t data;
 	uint16_t nvram[CHIP_MEMORY_SIZE];
 	uint8_t  locks[FLASH_BLOCK_MAX];
+	uint64_t programs; /**< completed word program operations */
+	uint64_t erases;   /**< completed block erase operations */
 } flash_t;
 
 typedef enum { /**@warning do not change the order or insert elements */
@@ -189,6 +227,18 @@ typedef struct {
 } vt100_attribute_t;
 
 #define VT100_MAX_SIZE (8192)
+#define VT100_MAX_ROWS (256)
+
+/* Screen cells are packed the way the VGA module stores them in its text
+ * RAM, a character in the lower byte and the attribute in the upper one:
+ * background in bits 8-10, foreground in bits 11-13, then bold and blink.
+ * Reverse video and conceal are resolved when a cell is written. */
+#define VT100_CELL_CHARACTER(C)  ((uint8_t)((C) & 0xFFu))
+#define VT100_CELL_BACKGROUND(C) (((C) >> 8)  & 0x7u)
+#define VT100_CELL_FOREGROUND(C) (((C) >> 11) & 0x7u)
+#define VT100_CELL_BOLD          (1u << 14)
+#define VT100_CELL_BLINK         (1u << 15)
+#define VT100_CELL_BLANK         (0x3800u | ' ') /**< white on black space */
 
 typedef struct {
 	size_t cursor;
@@ -201,8 +251,10 @@ typedef struct {
 	bool blinks;
 	bool cursor_on;
 	vt100_attribute_t attribute, attribute_saved;
-	vt100_attribute_t attributes[VT100_MAX_SIZE];
-	uint8_t m[VT100_MAX_SIZE];
+	unsigned top; /**< physical row holding logical row zero, scrolling rotates it */
+	uint16_t cells[VT100_MAX_SIZE];
+	uint64_t generation; /**< changes whenever anything is written to the terminal */
+	uint32_t dirty[VT100_MAX_ROWS / 32]; /**< logical rows changed since 'vt100_clean' */
 	uint8_t command_index;
 } vt100_t;
 
@@ -231,44 +283,93 @@ typedef struct {
 	bool wait;
 	bool interrupt;
 	uint8_t interrupt_selector;
+	bool halt; /**< set by an I/O handler to make 'h2_run' return -1 */
 
 	uint16_t uart_tx_baud, uart_rx_baud, uart_control;
+
+	struct h2_terminal *terminal; /**< NULL when 'vt100' is updated by the I/O handlers */
 } h2_soc_state_t;
 
-typedef uint16_t (*h2_io_get)(h2_soc_state_t *soc, uint16_t addr, bool *debug_on);
-typedef void     (*h2_io_set)(h2_soc_state_t *soc, uint16_t addr, uint16_t value, bool *debug_on);
-typedef void     (*h2_io_update)(h2_soc_state_t *soc);
+typedef uint16_t (*h2_io_get)(h2_soc_state_t *soc, uint16_t addr, bool *debug_on, void *param);
+typedef void     (*h2_io_set)(h2_soc_state_t *soc, uint16_t addr, uint16_t value, bool *debug_on, void *param);
+typedef void     (*h2_io_update)(h2_soc_state_t *soc, void *param);
 
 typedef struct {
-	h2_io_get in;
-	h2_io_set out;
+	h2_io_get get;
+	void *param;
+} h2_io_input_t;
+
+typedef struct {
+	h2_io_set set;
+	void *param;
+} h2_io_output_t;
+
+#define H2_PERIPHERALS_MAX (16u)
+#define H2_PLUGINS_MAX     (8u)
+#define H2_PLUGIN_REGISTER "h2_plugin_register" /**< symbol looked up in plugins */
+
+/**@brief A peripheral is anything that needs to run alongside the CPU, its
+ * 'update' hook is called every 'period' cycles (one or more), and 'free' is
+ * called on 'param' when the I/O system is destroyed. Its registers are
+ * installed separately with 'h2_io_register_input/output'. */
+typedef struct {
+	const char *name;
 	h2_io_update update;
+	void (*free)(void *param);
+	void *param;
+	unsigned period;
+	unsigned countdown; /**< internal, cycles until next update */
+} h2_peripheral_t;
+
+typedef struct h2_io {
+	h2_io_input_t in[H2_IO_REGISTERS + 1];   /**< indexed by H2_IO_SLOT */
+	h2_io_output_t out[H2_IO_REGISTERS + 1]; /**< indexed by H2_IO_SLOT */
+	h2_peripheral_t peripherals[H2_PERIPHERALS_MAX];
+	size_t peripheral_count;
+	void *plugins[H2_PLUGINS_MAX];
+	size_t plugin_count;
 	h2_soc_state_t *soc;
 } h2_io_t;
 
+/**@brief Plugins are shared objects exporting H2_PLUGIN_REGISTER with this
+ * type, 'arguments' is anything following a ',' in the plugin name given to
+ * 'h2_io_plugin_load'. Return negative on failure. */
+typedef int (*h2_plugin_register_t)(h2_io_t *io, const char *arguments);
+
+#define X_MACRO_INPUT_REGISTERS\
+	X(iUart,        0x4000)\
+	X(iVT100,       0x4002)\
+	X(iTimerDin,    0x4004)\
+	X(iSwitches,    0x4006)\
+	X(iMemDin,      0x4008)
+
+#define X_MACRO_OUTPUT_REGISTERS\
+	X(oUart,        0x4000)\
+	X(oVT100,       0x4002)\
+	X(oTimerCtrl,   0x4004)\
+	X(oLeds,        0x4006)\
+	X(oMemDout,     0x4008)\
+	X(oMemControl,  0x400A)\
+	X(oMemAddrLow,  0x400C)\
+	X(o7SegLED,     0x400E)\
+	X(oIrcMask,     0x4010)\
+	X(oUartTxBaud,  0x4012)\
+	X(oUartRxBaud,  0x4014)\
+	X(oUartControl, 0x4016)
+
 typedef enum {
-	iUart         = 0x4000,
-	iVT100        = 0x4002,
-	iTimerDin     = 0x4004,
-	iSwitches     = 0x4006,
-	iMemDin       = 0x4008,
+#define X(NAME, ADDRESS) NAME = ADDRESS,
+	X_MACRO_INPUT_REGISTERS
+#undef X
 } h2_input_addr_t;
 
 typedef enum {
-	oUart         = 0x4000,
-	oVT100        = 0x4002,
-	oTimerCtrl    = 0x4004,
-	oLeds         = 0x4006,
-	oMemDout      = 0x4008,
-	oMemControl   = 0x400A,
-	oMemAddrLow   = 0x400C,
-	o7SegLED      = 0x400E,
-	oIrcMask      = 0x4010,
-	oUartTxBaud   = 0x4012,
-	oUartRxBaud   = 0x4014,
-	oUartControl  = 0x4016,
+#define X(NAME, ADDRESS) NAME = ADDRESS,
+	X_MACRO_OUTPUT_REGISTERS
+#undef X
 } h2_output_addr_t;
 
+
 typedef enum {
 	isrEntry,
 	isrRxFifoNotEmpty,
@@ -288,6 +389,8 @@ void h2_free(h2_t *h);
 int h2_load(h2_t *h, FILE *hexfile);
 int h2_save(const h2_t *h, FILE *output, bool full);
 int h2_run(h2_t *h, h2_io_t *io, FILE *output, unsigned steps, symbol_table_t *symbols, bool run_debugger, FILE *trace);
+symbol_table_t *symbol_table_load(FILE *input); /**< as saved by "h2 -S", NULL on failure */
+void symbol_table_free(symbol_table_t *t);
 
 uint16_t h2_io_memory_read_operation(const h2_soc_state_t *soc);
 void soc_print(FILE *out, const h2_soc_state_t *soc);
@@ -295,6 +398,131 @@ h2_soc_state_t *h2_soc_state_new(void);
 void h2_soc_state_free(h2_soc_state_t *soc);
 h2_io_t *h2_io_new(void);
 void h2_io_free(h2_io_t *io);
+int h2_io_register_input(h2_io_t *io, uint16_t addr, h2_io_get get, void *param);
+int h2_io_register_output(h2_io_t *io, uint16_t addr, h2_io_set set, void *param);
+int h2_io_register_peripheral(h2_io_t *io, const h2_peripheral_t *peripheral);
+int h2_io_plugin_load(h2_io_t *io, const char *name);
+
+static inline uint16_t h2_io_read(h2_io_t *io, uint16_t addr, bool *debug_on) {
+	const h2_io_input_t *r = &io->in[H2_IO_SLOT(addr)];
+	return r->get(io->soc, addr, debug_on, r->param);
+}
+
+static inline void h2_io_write(h2_io_t *io, uint16_t addr, uint16_t value, bool *debug_on) {
+	const h2_io_output_t *w = &io->out[H2_IO_SLOT(addr)];
+	w->set(io->soc, addr, value, debug_on, w->param);
+}
+
+const char *h2_io_register_name(uint16_t addr, bool output);
+int h2_stats_print(FILE *out, const h2_t *h, const h2_io_t *io, double seconds, bool json);
+int h2_profile_print(FILE *out, const h2_t *h); /**< "address count" lines, read by 'h2opt' */
+double wall_clock_seconds(void);
+
+/**@brief Keep emulated time (cycles at CLOCK_SPEED_HZ) locked to the wall
+ * clock, the caller runs a batch of cycles and then calls 'h2_pace', which
+ * sleeps off any time the simulation is ahead. */
+#define H2_PACE_BATCH  (0.001) /**< emulated seconds between calls to 'h2_pace' */
+#define H2_PACE_SLACK  (0.050) /**< seconds behind before catching up is abandoned */
+#define H2_PACE_REPORT (5.0)   /**< minimum seconds between reports of drift */
+
+typedef struct {
+	double ratio;    /**< emulated seconds per wall clock second, 1.0 = hardware */
+	double start;    /**< wall clock time at the reference point */
+	uint64_t cycles; /**< cycle count at the reference point */
+	double drift;    /**< total seconds lost because the host could not keep up */
+	double reported; /**< wall clock time drift was last reported */
+} h2_pace_t;
+
+void h2_pace_start(h2_pace_t *p, double ratio, uint64_t cycles);
+double h2_pace(h2_pace_t *p, uint64_t cycles);
+
+#ifdef __GNUC__
+#define H2_LOAD_ACQUIRE(P)     __atomic_load_n((P), __ATOMIC_ACQUIRE)
+#define H2_LOAD_RELAXED(P)     __atomic_load_n((P), __ATOMIC_RELAXED)
+#define H2_STORE_RELEASE(P, V) __atomic_store_n((P), (V), __ATOMIC_RELEASE)
+#define H2_STORE_RELAXED(P, V) __atomic_store_n((P), (V), __ATOMIC_RELAXED)
+#define H2_EXCHANGE(P, V)      __atomic_exchange_n((P), (V), __ATOMIC_ACQ_REL)
+#define H2_FENCE_ACQUIRE()     __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define H2_FENCE_RELEASE()     __atomic_thread_fence(__ATOMIC_RELEASE)
+#else /**@warning without compiler support these are not safe across threads */
+#define H2_LOAD_ACQUIRE(P)     (*(P))
+#define H2_LOAD_RELAXED(P)     (*(P))
+#define H2_STORE_RELEASE(P, V) (*(P) = (V))
+#define H2_STORE_RELAXED(P, V) (*(P) = (V))
+#define H2_EXCHANGE(P, V)      h2_exchange_unsafe((P), (V))
+#define H2_FENCE_ACQUIRE()
+#define H2_FENCE_RELEASE()
+static inline unsigned h2_exchange_unsafe(unsigned *p, const unsigned v) { const unsigned o = *p; *p = v; return o; }
+#endif
+
+#define H2_SHM_MAGIC   (0x48325348ul) /**< "H2SH" */
+#define H2_SHM_VERSION (4u)
+#define H2_SHM_PREFIX  ("/h2-")       /**< segments are named by prefix and process id */
+
+/**@brief A snapshot of a running simulation published in POSIX shared
+ * memory for external viewers such as 'h2top'. The 'sequence' field is a
+ * sequence lock, it is odd whilst an update is in progress, readers should
+ * use 'h2_shm_read' to get a consistent copy. */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sequence;
+	uint32_t pid;
+	uint32_t exited;  /**< set when the simulation has finished */
+	double   seconds; /**< wall clock time the simulation has been running */
+	h2_stats_t stats;
+	uint16_t pc, tos, rp, sp, rpm, spm, ie;
+	uint16_t rstk[STK_SIZE];
+	uint16_t dstk[STK_SIZE];
+
+	uint16_t leds, led_7_segments, switches;
+	uint16_t timer_control, timer, irc_mask, interrupt_selector;
+	uint16_t mem_control, mem_addr_low, mem_dout;
+	uint16_t uart_tx_baud, uart_rx_baud, uart_control;
+	uint16_t flash_mode, flash_status;
+	uint64_t flash_programs, flash_erases;
+
+	uint16_t vt100_width, vt100_height, vt100_cursor;
+	uint16_t screen[VGA_AREA]; /**< packed cells in display order */
+} h2_shm_snapshot_t;
+
+typedef struct {
+	char *name;
+	h2_shm_snapshot_t *snapshot;
+	bool owner;
+} h2_shm_t;
+
+h2_shm_t *h2_shm_new(const char *name);
+h2_shm_t *h2_shm_attach(const char *name);
+void h2_shm_free(h2_shm_t *shm);
+void h2_shm_publish(h2_shm_t *shm, const h2_t *h, const h2_io_t *io, double seconds, bool exited);
+int h2_shm_read(const h2_shm_t *shm, h2_shm_snapshot_t *copy);
+
+/**@brief A console connects the emulated UART to a pair of host file
+ * descriptors without ever blocking the simulation, a reader thread fills
+ * a receive FIFO of UART_FIFO_DEPTH characters and output is buffered. */
+typedef struct h2_console h2_console_t;
+
+#define H2_CONSOLE_UART     (1u << 0) /**< attach to the UART registers */
+#define H2_CONSOLE_KEYBOARD (1u << 1) /**< attach to the PS/2 keyboard and VT100 */
+#define H2_CONSOLE_PACED    (1u << 2) /**< move characters at the programmed baud rate */
+#define H2_CONSOLE_NO_IDLE  (1u << 3) /**< never sleep while polling, the simulation is paced elsewhere */
+#define H2_CONSOLE_NO_EXIT  (1u << 4) /**< at the end of input halt 'h2_run' instead of calling 'exit' */
+
+h2_console_t *h2_console_new(int input, int output);
+h2_console_t *h2_console_open(const char *name); /**< "stdio", "pty", "pty:link" or "unix:path" */
+void h2_console_free(h2_console_t *c);
+int h2_console_attach(h2_console_t *c, h2_io_t *io, unsigned options);
+void h2_console_flush(h2_console_t *c);
+
+/**@brief Output to the VT100 can be queued for a thread that runs the
+ * terminal emulation, so the simulation only pays for adding a character to
+ * a queue. Whilst a terminal thread is running 'soc->vt100' belongs to it,
+ * the simulation thread must call 'h2_terminal_sync' before reading it. */
+int h2_terminal_start(h2_soc_state_t *soc); /**< -1 if no thread could be started */
+void h2_terminal_stop(h2_soc_state_t *soc);  /**< applies queued output first */
+void h2_terminal_put(h2_soc_state_t *soc, uint8_t c);
+void h2_terminal_sync(h2_soc_state_t *soc);  /**< wait until all queued output is on screen */
 
 int binary_memory_save(FILE *output, const uint16_t *p, size_t length);
 int binary_memory_load(FILE *input, uint16_t *p, size_t length);
@@ -303,10 +531,19 @@ int nvram_load_and_transfer(h2_io_t *io, const char *name, bool transfer_to_sram
 
 typedef uint8_t fifo_data_t;
 
+#define FIFO_CACHE_LINE (64u)
+
+/**@brief A lock free ring buffer for exactly one producer thread and one
+ * consumer thread. 'head' is only written by the producer and 'tail' only by
+ * the consumer, they are free running counters kept on separate cache lines,
+ * the buffer is a power of two in length but holds at most 'size' items. */
 typedef struct {
 	size_t head;
+	uint8_t pad_head[FIFO_CACHE_LINE - sizeof(size_t)];
 	size_t tail;
+	uint8_t pad_tail[FIFO_CACHE_LINE - sizeof(size_t)];
 	size_t size;
+	size_t mask;
 	fifo_data_t *buffer;
 } fifo_t;
 
@@ -317,6 +554,10 @@ bool fifo_is_empty(const fifo_t * fifo);
 size_t fifo_count(const fifo_t * fifo);
 size_t fifo_push(fifo_t * fifo, fifo_data_t data);
 size_t fifo_pop(fifo_t * fifo, fifo_data_t * data);
+size_t fifo_push_n(fifo_t *fifo, const fifo_data_t *data, size_t n); /**< producer, returns number pushed */
+size_t fifo_pop_n(fifo_t *fifo, fifo_data_t *data, size_t n);        /**< consumer, returns number popped */
+size_t fifo_peek(const fifo_t *fifo, const fifo_data_t **span);     /**< consumer, contiguous items readable in place */
+void fifo_discard(fifo_t *fifo, size_t n);                          /**< consumer, drop 'n' items after a peek */
 
 /** @warning LOG_FATAL level kills the program */
 #define X_MACRO_LOGGING\
@@ -351,6 +592,45 @@ int logger(log_level_e level, const char *func,
 #define note(...)    logger(LOG_NOTE,    __func__, __LINE__, __VA_ARGS__)
 #define debug(...)   logger(LOG_DEBUG,   __func__, __LINE__, __VA_ARGS__)
 
+/** Tracepoints are compiled out entirely unless H2_TRACEPOINTS is defined,
+ * when compiled in each site costs a single test of a flag which can be
+ * switched on by name at run time with 'tracepoint_enable'. */
+#define X_MACRO_TRACEPOINTS\
+	X(TRACE_CPU,      "cpu")\
+	X(TRACE_IO_READ,  "io-read")\
+	X(TRACE_IO_WRITE, "io-write")\
+	X(TRACE_FLASH,    "flash")\
+	X(TRACE_VT100,    "vt100")
+
+typedef enum {
+#define X(ENUM, NAME) ENUM,
+	X_MACRO_TRACEPOINTS
+#undef X
+	TRACE_MAX
+} tracepoint_e;
+
+#ifdef __GNUC__
+#define TRACEPOINT_PRINTF __attribute__((format(printf, 4, 5)))
+#define H2_UNLIKELY(X)    __builtin_expect(!!(X), 0)
+#else
+#define TRACEPOINT_PRINTF
+#define H2_UNLIKELY(X)    (X)
+#endif
+
+int tracepoint_enable(const char *names, bool on);
+void tracepoint_emit(tracepoint_e tp, const char *func,
+		const unsigned line, const char *fmt, ...) TRACEPOINT_PRINTF;
+
+#ifdef H2_TRACEPOINTS
+extern bool tracepoints[TRACE_MAX];
+#define tracepoint(TP, ...) do {\
+		if (H2_UNLIKELY(tracepoints[(TP)]))\
+			tracepoint_emit((TP), __func__, __LINE__, __VA_ARGS__);\
+	} while (0)
+#else
+#define tracepoint(TP, ...) do { } while (0)
+#endif
+
 int memory_load(FILE *input, uint16_t *p, size_t length);
 int memory_save(FILE *output, const uint16_t *p, size_t length);
 
@@ -359,5 +639,35 @@ int memory_save(FILE *output, const uint16_t *p, size_t length);
 #define DELETE    (127)  /* ASCII delete */
 
 void vt100_update(vt100_t *t, uint8_t c);
+size_t vt100_write(vt100_t *t, const uint8_t *buf, size_t length);
+void vt100_clear(vt100_t *t);
+uint16_t vt100_cell_pack(vt100_attribute_t attribute, uint8_t c);
+vt100_attribute_t vt100_cell_attribute(uint16_t cell);
+const uint16_t *vt100_row(const vt100_t *t, unsigned y);
+uint16_t vt100_cell(const vt100_t *t, size_t index);
+uint8_t vt100_char(const vt100_t *t, size_t index);
+vt100_attribute_t vt100_attribute(const vt100_t *t, size_t index);
+void vt100_damage(vt100_t *t, unsigned first, unsigned last);
+bool vt100_row_dirty(const vt100_t *t, unsigned y);
+void vt100_clean(vt100_t *t);
+
+/**@brief The hardware font ROM, "font.bin", holds glyphs of 8 by 12 pixels
+ * stored as lines of '0' and '1' characters, the first 256 glyphs are used. */
+#define VGA_FONT_FILE   ("font.bin")
+#define VGA_FONT_WIDTH  (8)
+#define VGA_FONT_HEIGHT (12)
+#define VGA_FONT_GLYPHS (256)
+#define VGA_PIXELS_X    (VGA_WIDTH  * VGA_FONT_WIDTH)  /**< 640 */
+#define VGA_PIXELS_Y    (VGA_HEIGHT * VGA_FONT_HEIGHT) /**< 480 */
+
+/**@brief Rasterises a terminal into 24-bit RGB pixels without a display, so
+ * the screen of a simulation can be saved or compared. */
+typedef struct h2_framebuffer h2_framebuffer_t;
+
+int h2_font_load(const char *file, uint8_t glyphs[VGA_FONT_GLYPHS][VGA_FONT_HEIGHT]); /**< most significant bit is leftmost */
+h2_framebuffer_t *h2_framebuffer_new(const char *font); /**< NULL on failure */
+void h2_framebuffer_free(h2_framebuffer_t *f);
+const uint8_t *h2_framebuffer_render(h2_framebuffer_t *f, const vt100_t *t, bool blink_on, unsigned *width, unsigned *height);
+int h2_framebuffer_save(const h2_framebuffer_t *f, FILE *output); /**< binary PPM of the last render */
 
 #endif
@@ -0,0 +1,418 @@
+/**@file      h2opt.c
+ * @brief     Search for shorter equivalents of hot H2 instruction sequences
+ * @copyright Richard James Howe (2017-2019)
+ * @license   MIT
+ *
+ * Given an image and the execution counts made for it by the CLI simulator
+ * ("h2 -f profile.txt"), this program finds the sequences of ALU
+ * instructions that are run the most, then tries every ALU encoding (each
+ * operation, T->N, T->R, N->[T], R->PC and both stack deltas) to find a
+ * single instruction, or none at all, that does the same thing. A candidate
+ * is only accepted if running both on stacks of unknown values, with the
+ * results kept as expressions, leaves the same expressions in every live
+ * stack cell, the same return address and the same memory accesses in the
+ * same order. The results are printed as a rule table for the peephole
+ * optimizer in 'embed.fth'. */
+
+#include "h2.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LENGTH   (3)    /* longest sequence searched */
+#define MAX_TERMS    (4096) /* expressions made while checking one candidate */
+#define MAX_EFFECTS  (MAX_LENGTH * 2)
+#define WINDOW       (MAX_LENGTH * 2 + 1) /* stack cells reachable either side of the start */
+#define CELLS        (WINDOW * 2 + 1)
+#define ALU_CODES    (21)   /* operations 0-20, the undocumented literal is left out */
+
+#define ALU_OP(I)    (((I) >> 8) & 0x1F)
+#define IS_ALU(I)    (((I) & 0xE000) == 0x6000)
+#define R_TO_PC      (0x0010)
+#define N_TO_ADDR_T  (0x0020)
+#define T_TO_R       (0x0040)
+#define T_TO_N       (0x0080)
+
+typedef enum {
+	TERM_NONE,
+	TERM_T,     /**< top of stack at the start */
+	TERM_DSTK,  /**< variable stack cell at the start, 'value' is its index */
+	TERM_RSTK,  /**< return stack cell at the start */
+	TERM_SP,    /**< variable stack depth plus 'value' */
+	TERM_RP,    /**< return stack depth plus 'value' */
+	TERM_READ,  /**< result of effect number 'value' */
+	TERM_ALU,   /**< operation 'code' on 'a' and 'b' */
+} term_e;
+
+typedef struct {
+	uint8_t kind, code;
+	int16_t value;
+	uint16_t a, b;
+} term_t;
+
+typedef enum {
+	EFFECT_LOAD,      /**< "[t]", from memory or I/O */
+	EFFECT_STORE,     /**< N->[T] */
+	EFFECT_INTERRUPT, /**< "cpu!" */
+	EFFECT_ENABLED,   /**< "cpu?" */
+} effect_e;
+
+typedef struct {
+	uint8_t kind;
+	uint16_t address, value;
+} effect_t;
+
+typedef struct {
+	uint16_t t, d[CELLS], r[CELLS]; /* stacks are indexed from WINDOW at the start */
+	int sp, rp;
+	uint16_t pc; /* term of the return address jumped to, or zero */
+	effect_t effects[MAX_EFFECTS];
+	size_t effect_count;
+} state_t;
+
+typedef struct {
+	uint16_t code[MAX_LENGTH];
+	size_t length;
+	uint64_t count;     /* summed over every place it occurs */
+	uint16_t hottest;   /* address of the place run most */
+	uint64_t most;
+	int replacement;    /* instructions in the replacement, -1 if none found */
+	uint16_t result;
+} pattern_t;
+
+static term_t terms[MAX_TERMS];
+static size_t term_count = 1; /* zero is TERM_NONE */
+
+/* 1 = commutes, for "t+n", "t&n", "t|n", "t^n" and "t==n" */
+static const uint8_t commutes[ALU_CODES] = { [2] = 1, [3] = 1, [4] = 1, [5] = 1, [7] = 1 };
+
+static const char *help = "\
+usage ./h2opt [-h] [-l length] [-n count] [-L symbol.file] file.hex profile.txt\n\n\
+Brief:  Search for shorter equivalents of the hot ALU instruction sequences\n\
+        in an image, profiled with 'h2 -f profile.txt -r file.hex'\n\
+Options:\n\n\
+\t-h\tprint this help message and exit\n\
+\t-l #\tlongest sequence to search, 2 or 3 (default 3)\n\
+\t-n #\tprint at most # rules, most cycles saved first (default 32)\n\
+\t-L #\tload symbol file, to name where each sequence is run most\n\n\
+The rules are printed in the format of the 'rules' table in 'embed.fth'.\n\n\
+";
+
+static uint16_t term(const term_e kind, const unsigned code, const int value, const uint16_t a, const uint16_t b) {
+	if (term_count >= MAX_TERMS)
+		fatal("too many terms");
+	const term_t t = { .kind = kind, .code = code, .value = value, .a = a, .b = b };
+	terms[term_count] = t;
+	return term_count++;
+}
+
+static bool same(const uint16_t a, const uint16_t b) {
+	if (a == b)
+		return true;
+	const term_t *x = &terms[a], *y = &terms[b];
+	if (x->kind != y->kind || x->code != y->code || x->value != y->value)
+		return false;
+	if (x->kind != TERM_ALU)
+		return true;
+	if (same(x->a, y->a) && same(x->b, y->b))
+		return true;
+	return commutes[x->code] && same(x->a, y->b) && same(x->b, y->a);
+}
+
+static uint16_t alu(const unsigned code, const uint16_t t, const uint16_t n) {
+	if (code == 6 && terms[t].kind == TERM_ALU && terms[t].code == 6)
+		return terms[t].a; /* "invert invert" */
+	if ((code == 3 || code == 4) && same(t, n))
+		return t;          /* "dup and", "dup or" */
+	return term(TERM_ALU, code, 0, t, n);
+}
+
+static void state_new(state_t *s) {
+	static uint16_t base[CELLS * 2 + 1];
+	static size_t base_count = 0;
+	if (!base_count) {
+		base[0] = term(TERM_T, 0, 0, 0, 0);
+		for (int i = 0; i < CELLS; i++) {
+			base[1 + i]         = term(TERM_DSTK, 0, i - WINDOW, 0, 0);
+			base[1 + CELLS + i] = term(TERM_RSTK, 0, i - WINDOW, 0, 0);
+		}
+		base_count = term_count;
+	}
+	term_count = base_count;
+	memset(s, 0, sizeof(*s));
+	s->t  = base[0];
+	s->sp = WINDOW;
+	s->rp = WINDOW;
+	for (int i = 0; i < CELLS; i++) {
+		s->d[i] = base[1 + i];
+		s->r[i] = base[1 + CELLS + i];
+	}
+}
+
+static int delta(const unsigned d) {
+	static const int i[4] = { 0, 1, -2, -1 };
+	return i[d & 3];
+}
+
+static bool valid(const uint16_t instruction) {
+	if (!IS_ALU(instruction) || ALU_OP(instruction) >= ALU_CODES)
+		return false;
+	return !(ALU_OP(instruction) == 12 && (instruction & N_TO_ADDR_T)); /* stores to I/O are skipped */
+}
+
+static uint16_t effect(state_t *s, const effect_e kind, const uint16_t address, const uint16_t value) {
+	assert(s->effect_count < MAX_EFFECTS);
+	const effect_t e = { .kind = kind, .address = address, .value = value };
+	s->effects[s->effect_count++] = e;
+	return term(TERM_READ, 0, s->effect_count - 1, 0, 0);
+}
+
+/* The same steps, in the same order, as the ALU case of 'h2_run' in h2.c */
+static bool execute(state_t *s, const uint16_t instruction) {
+	if (!valid(instruction) || s->pc)
+		return false; /* nothing runs after a jump */
+	const unsigned code = ALU_OP(instruction);
+	const uint16_t t = s->t, n = s->d[s->sp], r = s->r[s->rp];
+	uint16_t tos = t;
+	if (instruction & R_TO_PC)
+		s->pc = r;
+	switch (code) {
+	case 0:  break;
+	case 1:  tos = n; break;
+	case 11: tos = r; break;
+	case 12: tos = effect(s, EFFECT_LOAD, t, 0); break;
+	case 14: tos = term(TERM_SP, 0, s->sp, 0, 0); break;
+	case 16: effect(s, EFFECT_INTERRUPT, t, 0); tos = n; break;
+	case 17: tos = effect(s, EFFECT_ENABLED, 0, 0); break;
+	case 18: tos = term(TERM_RP, 0, s->rp, 0, 0); break;
+	case 20: tos = term(TERM_ALU, code, 0, 0, 0); break;
+	default: tos = alu(code, t, n); break;
+	}
+	s->sp += delta(instruction);
+	s->rp += delta(instruction >> 2);
+	if (s->sp < 0 || s->sp >= CELLS || s->rp < 0 || s->rp >= CELLS)
+		return false;
+	if (instruction & T_TO_R)
+		s->r[s->rp] = t;
+	if (instruction & T_TO_N)
+		s->d[s->sp] = t;
+	if (instruction & N_TO_ADDR_T)
+		effect(s, EFFECT_STORE, t, n);
+	s->t = tos;
+	return true;
+}
+
+/* Cells above the stack pointers are dead, everything else must match */
+static bool equivalent(const state_t *a, const state_t *b) {
+	if (a->sp != b->sp || a->rp != b->rp || a->effect_count != b->effect_count)
+		return false;
+	if (!same(a->t, b->t) || (a->pc || b->pc) != (a->pc && b->pc) || (a->pc && !same(a->pc, b->pc)))
+		return false;
+	for (int i = 0; i <= a->sp; i++)
+		if (!same(a->d[i], b->d[i]))
+			return false;
+	for (int i = 0; i <= a->rp; i++)
+		if (!same(a->r[i], b->r[i]))
+			return false;
+	for (size_t i = 0; i < a->effect_count; i++) {
+		const effect_t *x = &a->effects[i], *y = &b->effects[i];
+		if (x->kind != y->kind || !same(x->address, y->address) || !same(x->value, y->value))
+			return false;
+	}
+	return true;
+}
+
+/* Returns the length of the replacement found for 'p', or -1 */
+static int search(pattern_t *p) {
+	state_t goal, s;
+	state_new(&goal);
+	for (size_t i = 0; i < p->length; i++)
+		if (!execute(&goal, p->code[i]))
+			return -1;
+	const size_t mark = term_count; /* candidates are checked against the goal's terms */
+	state_new(&s);
+	term_count = mark;
+	if (equivalent(&goal, &s))
+		return 0;
+	for (unsigned code = 0; code < ALU_CODES; code++)
+		for (unsigned low = 0; low < 0x100; low++) {
+			const uint16_t candidate = 0x6000 | (code << 8) | low;
+			state_new(&s);
+			term_count = mark;
+			if (execute(&s, candidate) && equivalent(&goal, &s)) {
+				p->result = candidate;
+				return 1;
+			}
+		}
+	return -1;
+}
+
+static int pattern_compare(const void *a, const void *b) {
+	const pattern_t *x = a, *y = b;
+	if (x->length != y->length)
+		return x->length < y->length ? -1 : 1;
+	return memcmp(x->code, y->code, sizeof(x->code));
+}
+
+static int saving_compare(const void *a, const void *b) {
+	const pattern_t *x = a, *y = b;
+	const uint64_t sx = x->count * (x->length - x->replacement), sy = y->count * (y->length - y->replacement);
+	return sx == sy ? pattern_compare(a, b) : sx < sy ? 1 : -1;
+}
+
+static uint64_t *profile_load(FILE *input) {
+	assert(input);
+	uint64_t *counts = allocate_or_die(MAX_CORE * sizeof(counts[0]));
+	unsigned address = 0;
+	uint64_t count = 0;
+	int r = 0;
+	while ((r = fscanf(input, "%x %"SCNu64, &address, &count)) == 2) {
+		if (address >= MAX_CORE)
+			fatal("invalid address in profile: %x", address);
+		counts[address] = count;
+	}
+	if (r != EOF)
+		fatal("invalid profile");
+	return counts;
+}
+
+/* Every run of ALU instructions in the image that has been executed, of
+ * each length, with only the last allowed to jump, merged by content. */
+static pattern_t *patterns_find(const h2_t *h, const uint64_t *counts, const size_t longest, size_t *found) {
+	size_t n = 0;
+	pattern_t *p = allocate_or_die(MAX_CORE * MAX_LENGTH * sizeof(*p));
+	for (size_t i = 0; i < MAX_CORE; i++) {
+		if (!counts[i])
+			continue;
+		for (size_t length = 2; length <= longest && i + length <= MAX_CORE; length++) {
+			pattern_t *q = &p[n];
+			memset(q, 0, sizeof(*q));
+			bool usable = true;
+			for (size_t j = 0; j < length && usable; j++) {
+				q->code[j] = h->core[i + j];
+				usable = valid(q->code[j]) && (j == length - 1 || !(q->code[j] & R_TO_PC));
+			}
+			if (!usable)
+				break;
+			q->length  = length;
+			q->count   = counts[i];
+			q->most    = counts[i];
+			q->hottest = i;
+			n++;
+		}
+	}
+	qsort(p, n, sizeof(*p), pattern_compare);
+	size_t m = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (m && !pattern_compare(&p[m - 1], &p[i])) {
+			p[m - 1].count += p[i].count;
+			if (p[i].most > p[m - 1].most) {
+				p[m - 1].most    = p[i].most;
+				p[m - 1].hottest = p[i].hottest;
+			}
+			continue;
+		}
+		p[m++] = p[i];
+	}
+	*found = m;
+	return p;
+}
+
+static const char *location(const symbol_table_t *symbols, const uint16_t address) {
+	const symbol_t *best = NULL;
+	if (!symbols)
+		return NULL;
+	for (size_t i = 0; i < symbols->length; i++) {
+		const symbol_t *s = symbols->symbols[i];
+		if (s->type != SYMBOL_TYPE_LABEL && s->type != SYMBOL_TYPE_CALL)
+			continue;
+		if (s->value <= address && (!best || s->value > best->value))
+			best = s;
+	}
+	return best ? best->id : NULL;
+}
+
+static void rules_print(FILE *out, pattern_t *p, const size_t count, const size_t limit, const symbol_table_t *symbols) {
+	size_t n = 0;
+	for (size_t i = 0; i < count; i++)
+		if (p[i].replacement >= 0)
+			p[n++] = p[i];
+	qsort(p, n, sizeof(*p), saving_compare);
+	for (size_t i = 0; i < n && i < limit; i++) {
+		const pattern_t *q = &p[i];
+		const char *where = location(symbols, q->hottest);
+		fprintf(out, "  $%04X , $%04X , $%04X , $%04X ,",
+			q->code[q->length - 1], q->code[q->length - 2],
+			q->length > 2 ? q->code[q->length - 3] : 0, q->replacement ? q->result : 0);
+		fprintf(out, " ( %"PRIu64" cycles, most at $%04X", q->count * (q->length - q->replacement), (unsigned)q->hottest);
+		if (where)
+			fprintf(out, " in %s", where);
+		fputs(" )\n", out);
+	}
+}
+
+int main(int argc, char **argv) {
+	long longest = MAX_LENGTH, limit = 32;
+	symbol_table_t *symbols = NULL;
+	int i = 1;
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		switch (argv[i][1]) {
+		case '\0': i++; goto done;
+		case 'h': fputs(help, stderr); return 0;
+		case 'l':
+			if (i >= (argc - 1))
+				goto fail;
+			longest = strtol(argv[++i], NULL, 0);
+			if (longest < 2 || longest > MAX_LENGTH)
+				goto fail;
+			break;
+		case 'n':
+			if (i >= (argc - 1))
+				goto fail;
+			limit = strtol(argv[++i], NULL, 0);
+			if (limit <= 0)
+				goto fail;
+			break;
+		case 'L':
+		{
+			if (i >= (argc - 1))
+				goto fail;
+			FILE *symfile = fopen_or_die(argv[++i], "rb");
+			symbols = symbol_table_load(symfile);
+			fclose(symfile);
+			if (!symbols)
+				fatal("could not load symbol file %s", argv[i]);
+			break;
+		}
+		default:
+		fail:
+			fatal("invalid argument '%s'\n%s", argv[i], help);
+		}
+	}
+done:
+	if (i != argc - 2)
+		fatal("expected an image and a profile\n%s", help);
+
+	h2_t *h = h2_new(0);
+	FILE *input = fopen_or_die(argv[i], "rb");
+	if (h2_load(h, input) < 0)
+		fatal("could not load image %s", argv[i]);
+	fclose(input);
+	input = fopen_or_die(argv[i + 1], "rb");
+	uint64_t *counts = profile_load(input);
+	fclose(input);
+
+	size_t found = 0;
+	pattern_t *p = patterns_find(h, counts, longest, &found);
+	for (size_t j = 0; j < found; j++)
+		p[j].replacement = search(&p[j]);
+	fprintf(stdout, "\\ %s, profile %s\n", argv[i], argv[i + 1]);
+	rules_print(stdout, p, found, limit, symbols);
+
+	free(p);
+	free(counts);
+	h2_free(h);
+	symbol_table_free(symbols);
+	return 0;
+}
@@ -0,0 +1,171 @@
+/**@file      h2top.c
+ * @brief     Watch running H2 simulations through shared memory
+ * @copyright Richard James Howe (2017-2019)
+ * @license   MIT
+ *
+ * The CLI simulator, when given the "-P" option, publishes its state to a
+ * POSIX shared memory segment every so many cycles (see 'h2_shm_publish' in
+ * h2.c). This program attaches to any number of those segments read only, so
+ * a long running simulation can be inspected without restarting it under the
+ * debugger. */
+
+#define _POSIX_C_SOURCE 200809L
+#include "h2.h"
+#include <assert.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_INSTANCES (64)
+#define SHM_DIRECTORY ("/dev/shm") /* where Linux keeps shared memory objects */
+
+typedef struct {
+	char name[256];
+	h2_shm_t *shm;
+	h2_shm_snapshot_t now, previous;
+	bool valid;
+} instance_t;
+
+static instance_t instances[MAX_INSTANCES];
+static size_t instance_count = 0;
+
+static const char *help = "\
+usage ./h2top [-h1s] [-d ms] [name...]\n\n\
+Brief:  Watch H2 simulations started with 'h2 -P cycles'\n\
+Options:\n\n\
+\t-h\tprint this help message and exit\n\
+\t-1\tprint a single report and exit\n\
+\t-s\tshow the VGA screen of the first instance\n\
+\t-d #\tdelay between updates in milliseconds (default 1000)\n\
+\tname\tshared memory names to watch, default is all of /h2-*\n\n\
+";
+
+static void instance_add(const char *name) {
+	assert(name);
+	if (instance_count >= MAX_INSTANCES) {
+		warning("too many instances, ignoring %s", name);
+		return;
+	}
+	for (size_t i = 0; i < instance_count; i++)
+		if (!strcmp(instances[i].name, name))
+			return;
+	instance_t *in = &instances[instance_count];
+	memset(in, 0, sizeof(*in));
+	snprintf(in->name, sizeof(in->name), "%s", name);
+	if (!(in->shm = h2_shm_attach(name)))
+		return;
+	instance_count++;
+}
+
+static void instance_scan(void) {
+	DIR *d = opendir(SHM_DIRECTORY);
+	if (!d)
+		return;
+	const size_t prefix = strlen(H2_SHM_PREFIX) - 1; /* skip leading '/' */
+	for (struct dirent *e = NULL; (e = readdir(d));) {
+		char name[sizeof(e->d_name) + 1] = { 0 };
+		if (strncmp(e->d_name, H2_SHM_PREFIX + 1, prefix))
+			continue;
+		snprintf(name, sizeof(name), "/%s", e->d_name);
+		instance_add(name);
+	}
+	closedir(d);
+}
+
+static double mips(const h2_shm_snapshot_t * const now, const h2_shm_snapshot_t * const previous) {
+	assert(now);
+	assert(previous);
+	const double seconds = now->seconds - previous->seconds;
+	if (seconds <= 0.)
+		return 0.;
+	return ((double)(now->stats.cycles - previous->stats.cycles) / seconds) / 1e6;
+}
+
+static void report(FILE *out, const bool screen) {
+	fprintf(out, "%-16s %8s %6s %14s %9s %9s %4s %4s %4s %4s %4s %8s %6s %6s\n",
+		"NAME", "PID", "STATE", "CYCLES", "MIPS", "MIPS-AVG", "PC", "SP", "RP", "LEDS", "7SEG", "IRQS", "PROG", "ERASE");
+	for (size_t i = 0; i < instance_count; i++) {
+		instance_t *in = &instances[i];
+		in->previous = in->now;
+		const bool had = in->valid;
+		in->valid = h2_shm_read(in->shm, &in->now) == 0;
+		if (!in->valid) {
+			fprintf(out, "%-16s (unreadable)\n", in->name);
+			continue;
+		}
+		const h2_shm_snapshot_t * const s = &in->now;
+		uint64_t irqs = 0;
+		for (size_t j = 0; j < NUMBER_OF_INTERRUPTS; j++)
+			irqs += s->stats.interrupts[j];
+		const double average = s->seconds > 0. ? ((double)s->stats.cycles / s->seconds) / 1e6 : 0.;
+		fprintf(out, "%-16s %8lu %6s %14"PRIu64" %9.3f %9.3f %04x %4u %4u %04x %04x %8"PRIu64" %6"PRIu64" %6"PRIu64"\n",
+			in->name, (unsigned long)s->pid, s->exited ? "exited" : "run",
+			s->stats.cycles, had ? mips(s, &in->previous) : 0., average,
+			(unsigned)s->pc, (unsigned)s->sp, (unsigned)s->rp,
+			(unsigned)s->leds, (unsigned)s->led_7_segments, irqs,
+			s->flash_programs, s->flash_erases);
+	}
+	if (screen && instance_count && instances[0].valid) {
+		const h2_shm_snapshot_t * const s = &instances[0].now;
+		const unsigned width = s->vt100_width, height = s->vt100_height;
+		fputc('\n', out);
+		for (unsigned y = 0; y < height && (y * width) < VGA_AREA; y++) {
+			for (unsigned x = 0; x < width; x++) {
+				const unsigned char c = VT100_CELL_CHARACTER(s->screen[y * width + x]);
+				fputc(c < 32 || c > 126 ? ' ' : c, out);
+			}
+			fputc('\n', out);
+		}
+	}
+	fflush(out);
+}
+
+static void sleep_ms(const long ms) {
+	struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000l };
+	nanosleep(&ts, NULL);
+}
+
+int main(int argc, char **argv) {
+	bool once = false, screen = false;
+	long delay = 1000;
+	int i = 1;
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		switch (argv[i][1]) {
+		case '\0': i++; goto done;
+		case 'h': fputs(help, stderr); return 0;
+		case '1': once   = true; break;
+		case 's': screen = true; break;
+		case 'd':
+			if (i >= (argc - 1))
+				goto fail;
+			delay = strtol(argv[++i], NULL, 0);
+			if (delay <= 0)
+				goto fail;
+			break;
+		default:
+		fail:
+			fatal("invalid argument '%s'\n%s", argv[i], help);
+		}
+	}
+done:
+	for (; i < argc; i++)
+		instance_add(argv[i]);
+	const bool scan = instance_count == 0;
+
+	for (;;) {
+		if (scan)
+			instance_scan();
+		if (!once)
+			fputs("\033[H\033[2J", stdout);
+		report(stdout, screen);
+		if (once)
+			break;
+		sleep_ms(delay);
+	}
+
+	for (size_t j = 0; j < instance_count; j++)
+		h2_shm_free(instances[j].shm);
+	return 0;
+}
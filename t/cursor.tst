@@ -0,0 +1,8 @@
+PAGE
+CR
+
+.( ab) SAVE RED COLOR .( cd) RESTORE .( X) CR
+.( The line above should read 'abXd', with the 'X' not in red) CR
+
+0 SGR
+CR BYE